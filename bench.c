@@ -0,0 +1,282 @@
+/*
+ * Throughput of the inbound path, fed from generated in-memory corpora.
+ *
+ * Each corpus is run through progressively more of the stack:
+ *  - framing:    splitting reads into lines (irc_inbuf)
+ *  - parse:      irc_parse_message() on each line
+ *  - dispatch:   irc_feed() into a connection with do-nothing handlers
+ *  - user-track: irc_feed() into a connection tracking the channel
+ *
+ * Allocations are counted by wrapping malloc and friends at link time.
+ */
+#include "irc.h"
+#include "irc_inbuf.h"
+#include "user-track.h"
+
+#include <ccan/err/err.h>
+#include <ccan/array_size/array_size.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/* the size of each "read" */
+#define BENCH_CHUNK 4096
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+static size_t alloc_ct;
+
+void *__wrap_malloc(size_t size)
+{
+	alloc_ct++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	alloc_ct++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	alloc_ct++;
+	return __real_realloc(ptr, size);
+}
+
+struct corpus {
+	const char *name;
+	char *data;
+	size_t len;
+	size_t cap;
+	size_t lines;
+};
+
+static void PRINTF_FMT(2,3) corpus_add(struct corpus *co, const char *fmt, ...)
+{
+	va_list va;
+	for (;;) {
+		va_start(va, fmt);
+		size_t r = vsnprintf(co->data + co->len, co->cap - co->len, fmt, va);
+		va_end(va);
+		if (r < co->cap - co->len) {
+			co->len += r;
+			break;
+		}
+
+		co->cap = co->cap ? co->cap * 2 : 1 << 20;
+		co->data = realloc(co->data, co->cap);
+		if (!co->data)
+			err(1, "corpus allocation");
+	}
+
+	co->lines++;
+}
+
+static void gen_privmsg_storm(struct corpus *co, size_t lines)
+{
+	size_t i;
+	for (i = 0; i < lines; i++) {
+		/* some servers tag everything, some nothing */
+		char tags[64] = "";
+		if (i % 4 == 0)
+			snprintf(tags, sizeof(tags), "@time=2014-10-11T12:00:00.%03zuZ;msgid=%zx ",
+					i % 1000, i);
+		corpus_add(co, "%s:nick%zu!~user%zu@host-%zu.example.net PRIVMSG #chan :"
+				"message %zu, the quick brown fox jumps over the lazy dog\r\n",
+				tags, i % 500, i % 500, i % 500, i);
+	}
+}
+
+static void gen_names_flood(struct corpus *co, size_t nicks)
+{
+	size_t i = 0;
+	while (i < nicks) {
+		char line[IRC_MAX_LINE_LENGTH];
+		size_t used = 0;
+		while (i < nicks && used < 400) {
+			static const char *const marker[] = { "", "", "", "+", "@" };
+			used += snprintf(line + used, sizeof(line) - used, "%s%snick%zu",
+					used ? " " : "", marker[i % ARRAY_SIZE(marker)], i);
+			i++;
+		}
+		corpus_add(co, ":irc.example.net 353 me = #chan :%s\r\n", line);
+	}
+	corpus_add(co, ":irc.example.net 366 me #chan :End of /NAMES list.\r\n");
+}
+
+static void gen_join_part_churn(struct corpus *co, size_t rounds, size_t nicks)
+{
+	size_t r, i;
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < nicks; i++)
+			corpus_add(co, ":churn%zu!~u@host-%zu.example.net JOIN #chan\r\n", i, i);
+		for (i = 0; i < nicks; i++)
+			corpus_add(co, ":churn%zu!~u@host-%zu.example.net PART #chan :bye\r\n", i, i);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const struct corpus *co, const char *stage, double secs,
+		size_t allocs)
+{
+	printf("%-16s %-10s %9zu lines %8.1f ns/line %12.0f lines/s %8.4f allocs/line\n",
+			co->name, stage, co->lines, secs * 1e9 / co->lines,
+			co->lines / secs, (double)allocs / co->lines);
+}
+
+static void line_nop(void *ctx, char *line, size_t len)
+{
+	(*(size_t *)ctx)++;
+}
+
+static void bench_framing(const struct corpus *co)
+{
+	struct irc_inbuf in;
+	size_t pos, lines = 0;
+	irc_inbuf_init(&in);
+
+	size_t a = alloc_ct;
+	double t = now();
+	for (pos = 0; pos < co->len;) {
+		struct iovec iov[2];
+		int i, ct = irc_inbuf_prepare(&in, IRC_IN_BUF_MAX, iov);
+		for (i = 0; i < ct && pos < co->len; i++) {
+			size_t n = co->len - pos;
+			if (n > iov[i].iov_len)
+				n = iov[i].iov_len;
+			if (n > BENCH_CHUNK)
+				n = BENCH_CHUNK;
+			memcpy(iov[i].iov_base, co->data + pos, n);
+			irc_inbuf_commit(&in, n);
+			pos += n;
+		}
+		irc_inbuf_lines(&in, SIZE_MAX, line_nop, &lines);
+	}
+	t = now() - t;
+
+	report(co, "framing", t, alloc_ct - a);
+	if (lines != co->lines)
+		warnx("framing: expected %zu lines, got %zu", co->lines, lines);
+	irc_inbuf_free(&in);
+}
+
+static void bench_parse(const struct corpus *co)
+{
+	const char *p = co->data, *end = co->data + co->len;
+	struct irc_message m;
+	size_t bad = 0;
+
+	size_t a = alloc_ct;
+	double t = now();
+	while (p < end) {
+		const char *nl = memchr(p, '\n', end - p);
+		if (irc_parse_message(&m, p, nl - p - 1))
+			bad++;
+		p = nl + 1;
+	}
+	t = now() - t;
+
+	report(co, "parse", t, alloc_ct - a);
+	if (bad)
+		warnx("parse: %zu lines did not parse", bad);
+}
+
+static int on_nop(struct irc_connection *c, struct irc_operation *op,
+		const struct irc_message *m)
+{
+	return 0;
+}
+
+static void bench_feed(const struct corpus *co, const char *stage,
+		struct irc_connection *c)
+{
+	size_t pos;
+	size_t a = alloc_ct;
+	double t = now();
+	for (pos = 0; pos < co->len; pos += BENCH_CHUNK) {
+		size_t n = co->len - pos;
+		if (n > BENCH_CHUNK)
+			n = BENCH_CHUNK;
+		irc_feed(c, co->data + pos, n);
+	}
+	t = now() - t;
+	report(co, stage, t, alloc_ct - a);
+}
+
+static void bench_dispatch(const struct corpus *co)
+{
+	struct irc_connection c = { .nick = "me", .nick_len = 2 };
+	irc_init(&c);
+	struct irc_operation ops[] = {
+		IRC_OP_STR_INIT(on_nop, "PRIVMSG"),
+		IRC_OP_STR_INIT(on_nop, "JOIN"),
+		IRC_OP_STR_INIT(on_nop, "PART"),
+		{ .type = IRC_OP_NUM, .num = RPL_NAMREPLY, .cb = on_nop },
+		{ .type = IRC_OP_NUM, .num = RPL_ENDOFNAMES, .cb = on_nop },
+	};
+	size_t i;
+	for (i = 0; i < ARRAY_SIZE(ops); i++)
+		irc_add_operation(&c, &ops[i]);
+
+	bench_feed(co, "dispatch", &c);
+	irc_inbuf_free(&c.in);
+}
+
+static void bench_user_track(const struct corpus *co)
+{
+	struct irc_connection c = { .nick = "me", .nick_len = 2 };
+	struct irc_usertrack_channel ut;
+	irc_init(&c);
+	irc_ut_channel_init(&ut, "#chan");
+	irc_add_usertrack_channel(&c, &ut);
+	struct irc_operation ops[] = {
+		IRC_OP_STR_INIT(on_nop, "PRIVMSG"),
+		{ .type = IRC_OP_NUM, .num = RPL_ENDOFNAMES, .cb = on_nop },
+	};
+	size_t i;
+	for (i = 0; i < ARRAY_SIZE(ops); i++)
+		irc_add_operation(&c, &ops[i]);
+
+	bench_feed(co, "user-track", &c);
+	irc_remove_usertrack_channel(&c, &ut);
+	irc_inbuf_free(&c.in);
+}
+
+int main(int argc, char **argv)
+{
+	err_set_progname(argv[0]);
+
+	struct corpus corpora[] = {
+		{ .name = "privmsg-storm" },
+		{ .name = "names-flood" },
+		{ .name = "join-part-churn" },
+	};
+
+	gen_privmsg_storm(&corpora[0], 200000);
+	gen_names_flood(&corpora[1], 50000);
+	gen_join_part_churn(&corpora[2], 10, 10000);
+
+	size_t i;
+	for (i = 0; i < ARRAY_SIZE(corpora); i++) {
+		bench_framing(&corpora[i]);
+		bench_parse(&corpora[i]);
+		bench_dispatch(&corpora[i]);
+		bench_user_track(&corpora[i]);
+		free(corpora[i].data);
+	}
+
+	return 0;
+}
@@ -2,10 +2,15 @@
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <limits.h>
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netdb.h>
 
@@ -33,22 +38,157 @@
  */
 
 #include "irc.h"
-int irc_cmd(struct irc_connection *c,
-		char const *msg, size_t msg_len)
+#include "irc_inbuf.h"
+#include "irc_outq.h"
+#include "irc_sched.h"
+#include "irc_dns.h"
+#include "irc_connector.h"
+#include "parse-c-struct-izl.h"
+
+/* make sure the queue gets written out once the loop comes around */
+static void irc_out_kick(struct irc_connection *c)
+{
+	if (c->fd >= 0)
+		c->io->kick(c);
+}
+
+/* hand whatever the send pacing allows to the output queue */
+static void irc_send_run(struct irc_connection *c)
+{
+	/* held until (re)connected, where registration will go first */
+	if (c->fd < 0)
+		return;
+
+	ev_tstamp now = ev_now(c->loop);
+	if (irc_sched_run(&c->sched, now, &c->out))
+		irc_out_kick(c);
+
+	double delay = irc_sched_delay(&c->sched, now);
+	if (delay > 0 && !ev_is_active(&c->send_timer)) {
+		ev_timer_set(&c->send_timer, delay, 0);
+		ev_timer_start(c->loop, &c->send_timer);
+	}
+}
+
+static void send_timer_cb(EV_P_ ev_timer *w, int revents)
 {
-	ssize_t r = write(c->w.fd, msg, msg_len);
-	if ((size_t)r != msg_len)
-		return (r < 0)?r:-1;
+	struct irc_connection *c = container_of(w, typeof(*c), send_timer);
+	irc_send_run(c);
+}
+
+enum irc_prio irc_cmd_prio_of(char const *msg, size_t msg_len)
+{
+	const char *end = msg + msg_len;
+	if (msg < end && *msg == '@') {
+		msg = memchr(msg, ' ', msg_len);
+		if (!msg)
+			return IRC_PRIO_BULK;
+		msg++;
+	}
 
+	const char *v = msg;
+	while (msg < end && *msg != ' ' && *msg != '\r')
+		msg++;
+	size_t v_len = msg - v;
+
+	switch (irc_cmd_lookup(v, v_len)) {
+	case IRC_CMD_PING:
+	case IRC_CMD_PONG:
+	case IRC_CMD_NICK:
+	case IRC_CMD_QUIT:
+	case IRC_CMD_CAP:
+	case IRC_CMD_AUTHENTICATE:
+		return IRC_PRIO_URGENT;
+	case IRC_CMD_JOIN:
+	case IRC_CMD_PART:
+	case IRC_CMD_MODE:
+	case IRC_CMD_KICK:
+	case IRC_CMD_TOPIC:
+	case IRC_CMD_INVITE:
+	case IRC_CMD_AWAY:
+		return IRC_PRIO_CONTROL;
+	case IRC_CMD_UNKNOWN:
+		if (memeqstr(v, v_len, "PASS") || memeqstr(v, v_len, "USER"))
+			return IRC_PRIO_URGENT;
+		/* fall through */
+	default:
+		return IRC_PRIO_BULK;
+	}
+}
+
+static void irc_cmd_queued(struct irc_connection *c, char const *msg,
+		size_t msg_len)
+{
 	if (debug_is(2)) {
-		printf("< %zd ", r);
-		print_bytes_as_cstring(msg, r, stdout);
+		printf("< %zd ", msg_len);
+		print_bytes_as_cstring(msg, msg_len, stdout);
 		putchar('\n');
 	}
+}
+
+int irc_cmd_prio(struct irc_connection *c, enum irc_prio prio,
+		char const *msg, size_t msg_len)
+{
+	if (irc_sched_push(&c->sched, prio, ev_now(c->loop), msg, msg_len)) {
+		pr_debug(1, "could not queue command, dropping.");
+		return -1;
+	}
+
+	irc_cmd_queued(c, msg, msg_len);
+	irc_send_run(c);
+	return 0;
+}
+
+int irc_cmd(struct irc_connection *c,
+		char const *msg, size_t msg_len)
+{
+	return irc_cmd_prio(c, irc_cmd_prio_of(msg, msg_len), msg, msg_len);
+}
+
+/* irc_cmd_spans() without kicking the scheduler, to queue several at once */
+static int irc_cmd_spans_queue(struct irc_connection *c,
+		const struct arg *parts, size_t part_ct)
+{
+	size_t i, len = 2;
+	for (i = 0; i < part_ct; i++)
+		len += parts[i].len;
+
+	if (len > IRC_MAX_LINE_LENGTH + 2) {
+		pr_debug(1, "oversized command (%zu bytes), dropping.", len);
+		return -1;
+	}
+
+	enum irc_prio prio = part_ct
+		? irc_cmd_prio_of(parts[0].data, parts[0].len)
+		: IRC_PRIO_BULK;
+	char *line = irc_sched_reserve(&c->sched, prio, ev_now(c->loop), len);
+	if (!line) {
+		pr_debug(1, "could not queue command, dropping.");
+		return -1;
+	}
+
+	char *p = line;
+	for (i = 0; i < part_ct; i++) {
+		memcpy(p, parts[i].data, parts[i].len);
+		p += parts[i].len;
+	}
+	*p++ = '\r';
+	*p++ = '\n';
 
+	irc_sched_commit(&c->sched, prio, len);
+	irc_cmd_queued(c, line, len);
 	return 0;
 }
 
+int irc_cmd_spans(struct irc_connection *c,
+		const struct arg *parts, size_t part_ct)
+{
+	int r = irc_cmd_spans_queue(c, parts, part_ct);
+	if (!r)
+		irc_send_run(c);
+	return r;
+}
+
 int irc_cmd_fmt(struct irc_connection *c, char const *str, ...)
 {
 	char buf[1024];
@@ -68,26 +208,169 @@ int irc_cmd_fmt(struct irc_connection *c, char const *str, ...)
 	return irc_cmd(c, buf, sz);
 }
 
+size_t irc_privmsg_room(struct irc_connection *c, size_t dest_len)
+{
+	size_t prefix = c->self_prefix_len;
+	if (!prefix)
+		prefix = c->nick_len + IRC_USER_HOST_MAX;
+
+	/* what others get is ":<prefix> PRIVMSG <dest> :<msg>" */
+	return SUB_SAT(IRC_MAX_LINE_LENGTH,
+			1 + prefix + 1 + strlen("PRIVMSG ") + dest_len + 2);
+}
+
+/*
+ * the length of the next fragment of @msg that fits in @room, which is cut
+ * after the last space that fits, or otherwise at a UTF-8 character boundary.
+ * @skip is set to the bytes between this fragment and the next.
+ */
+static size_t privmsg_fragment(const char *msg, size_t msg_len, size_t room,
+		size_t *skip)
+{
+	*skip = 0;
+	if (msg_len <= room)
+		return msg_len;
+
+	/* a space right at the limit may be dropped too */
+	size_t n = room;
+	while (n && msg[n] != ' ')
+		n--;
+	if (n) {
+		*skip = 1;
+		return n;
+	}
+
+	/* no space, don't split a multi-byte character */
+	n = room;
+	while (n && (msg[n] & 0xc0) == 0x80)
+		n--;
+	return n ? n : room;
+}
+
+int irc_cmd_privmsg(struct irc_connection *c,
+		char const *dest, size_t dest_len,
+		char const *msg,  size_t msg_len)
+{
+	size_t room = irc_privmsg_room(c, dest_len);
+	/* room for at least one character */
+	if (room < 4) {
+		pr_debug(1, "no room to PRIVMSG %.*s, dropping.", (int)dest_len, dest);
+		return -1;
+	}
+
+	struct arg parts[] = {
+		IRC_ARG_LIT("PRIVMSG "),
+		{ dest, dest_len },
+		IRC_ARG_LIT(" :"),
+		{},
+	};
+
+	const char *end = msg + msg_len;
+	int r = 0;
+	while (msg < end) {
+		const char *nl = memchr(msg, '\n', end - msg);
+		const char *eol = nl ? nl : end;
+		const char *next = nl ? nl + 1 : end;
+		if (eol > msg && eol[-1] == '\r')
+			eol--;
+
+		while (msg < eol) {
+			size_t skip, n = privmsg_fragment(msg, eol - msg, room, &skip);
+			parts[3] = (struct arg){ msg, n };
+			if (irc_cmd_spans_queue(c, parts, ARRAY_SIZE(parts)))
+				r = -1;
+			msg += n + skip;
+		}
+
+		msg = next;
+	}
+
+	irc_send_run(c);
+	return r;
+}
+
+/* the longest line in @msg, which is what has to fit for it to not be split */
+static size_t longest_line(const char *msg, size_t msg_len)
+{
+	const char *end = msg + msg_len;
+	size_t longest = 0;
+	while (msg < end) {
+		const char *nl = memchr(msg, '\n', end - msg);
+		size_t l = (nl ? nl : end) - msg;
+		if (l > longest)
+			longest = l;
+		msg += l + 1;
+	}
+	return longest;
+}
+
+int irc_cmd_privmsg_multi(struct irc_connection *c,
+		const struct arg *dests, size_t dest_ct,
+		char const *msg, size_t msg_len)
+{
+	size_t max = c->isupport.privmsg_targets;
+	if (!max)
+		max = 1;
+
+	/* a message that must be split anyway keeps at least half a line */
+	size_t need = MIN(longest_line(msg, msg_len), IRC_MAX_LINE_LENGTH / 2);
+
+	char targets[IRC_MAX_LINE_LENGTH];
+	size_t used = 0, ct = 0, i;
+	int r = 0;
+	for (i = 0; i < dest_ct; i++) {
+		const struct arg *d = &dests[i];
+		size_t more = used + !!ct + d->len;
+		if (ct && (ct >= max || more > sizeof(targets)
+				|| irc_privmsg_room(c, more) < need)) {
+			if (irc_cmd_privmsg(c, targets, used, msg, msg_len))
+				r = -1;
+			used = 0;
+			ct = 0;
+		}
+
+		if (d->len > sizeof(targets)) {
+			pr_debug(1, "oversized target %.*s, skipping.",
+					(int)d->len, d->data);
+			r = -1;
+			continue;
+		}
+
+		if (ct)
+			targets[used++] = ',';
+		memcpy(targets + used, d->data, d->len);
+		used += d->len;
+		ct++;
+	}
+
+	if (ct && irc_cmd_privmsg(c, targets, used, msg, msg_len))
+		r = -1;
+	return r;
+}
+
+/* only the message itself is formatted, the rest is already spans */
 int irc_cmd_privmsg_va(struct irc_connection *c,
 		char const *dest, size_t dest_len,
 		char const *msg_fmt, va_list va)
 {
 	char buf[1024];
-	size_t sz = snprintf(buf, sizeof(buf), "PRIVMSG %.*s :", (int)dest_len, dest);
-	if (sz >= sizeof(buf) - 2)
-		goto overflow;
-
-	sz += vsnprintf(buf + sz, sizeof(buf) - sz, msg_fmt, va);
-	if (sz >= sizeof(buf) - 2)
-		goto overflow;
-
-	buf[sz++] = '\r';
-	buf[sz++] = '\n';
+	va_list va2;
+	va_copy(va2, va);
+	int sz = vsnprintf(buf, sizeof(buf), msg_fmt, va2);
+	va_end(va2);
+	if (sz < 0)
+		return -1;
+	if ((size_t)sz < sizeof(buf))
+		return irc_cmd_privmsg(c, dest, dest_len, buf, sz);
 
-	return irc_cmd(c, buf, sz);
-overflow:
-	pr_debug(1, "oversized irc_cmd_privmsg_fmt, dropping.");
-	return -1;
+	/* long enough to be split, so no need to avoid the allocation */
+	char *big = malloc(sz + 1);
+	if (!big)
+		return -1;
+	vsnprintf(big, sz + 1, msg_fmt, va);
+	int r = irc_cmd_privmsg(c, dest, dest_len, big, sz);
+	free(big);
+	return r;
 }
 
 int irc_cmd_privmsg_fmt(struct irc_connection *c,
@@ -162,48 +445,192 @@ int irc_parse_args(char const *start, size_t len, struct arg *args,
 	return -1;
 }
 
-static char *irc_parse_prefix(char *start, size_t len, char **prefix, size_t *prefix_len)
+static const char *skip_spaces(const char *p, const char *end)
+{
+	while (p < end && *p == ' ')
+		p++;
+	return p;
+}
+
+/*
+ * prefix = servername / ( nickname [ [ "!" user ] "@" host ] )
+ */
+static void irc_address_parts(struct irc_message *m)
+{
+	const char *p = m->prefix.data;
+	const char *end = p + m->prefix.len;
+	const char *bang = memchr(p, '!', end - p);
+	const char *at = memchr(bang ? bang : p, '@', end - (bang ? bang : p));
+	const char *nick_end = bang ? bang : at ? at : end;
+
+	/* nicknames can't contain '.', server names do */
+	m->from_server = !bang && !at && memchr(p, '.', end - p);
+	if (m->from_server) {
+		m->nick = m->user = (struct arg){ NULL, 0 };
+		m->host = m->prefix;
+		return;
+	}
+
+	m->nick = (struct arg){ p, nick_end - p };
+	if (bang)
+		m->user = (struct arg){ bang + 1, (at ? at : end) - (bang + 1) };
+	else
+		m->user = (struct arg){ NULL, 0 };
+	if (at)
+		m->host = (struct arg){ at + 1, end - (at + 1) };
+	else
+		m->host = (struct arg){ NULL, 0 };
+}
+
+/*
+ * [ '@' tags SPACE ] [ ':' prefix SPACE ] command [ params ]
+ */
+int irc_parse_message(struct irc_message *m, const char *start, size_t len)
 {
-	if (len <= 0 || *start != ':') {
-		*prefix = NULL;
-		*prefix_len = 0;
-		return start;
+	const char *p = start;
+	const char *end = start + len;
+
+	m->tags = (struct arg){ NULL, 0 };
+	m->prefix = (struct arg){ NULL, 0 };
+	m->nick = m->user = m->host = (struct arg){ NULL, 0 };
+	m->from_server = true;
+	m->num = 0;
+	m->param_ct = 0;
+
+	/* only find the end of the tags, they are picked apart on request */
+	if (*p == '@') {
+		const char *next = memchr(p + 1, ' ', end - (p + 1));
+		if (!next) {
+			pr_debug(0, "invalid packet: couldn't locate a space after the '@tags'");
+			return -EINVAL;
+		}
+
+		m->tags = (struct arg){ p + 1, next - (p + 1) };
+		p = skip_spaces(next, end);
+		if (p == end) {
+			pr_debug(0, "invalid packet: nothing after the '@tags'");
+			return -EINVAL;
+		}
+	}
+
+	if (*p == ':') {
+		/* the pkt starts with a nick or server name */
+		const char *next = memchr(p + 1, ' ', end - (p + 1));
+		if (!next) {
+			pr_debug(0, "invalid packet: couldn't locate a space after the first ':name'");
+			return -EINVAL;
+		}
+
+		m->prefix = (struct arg){ p + 1, next - (p + 1) };
+		irc_address_parts(m);
+		p = skip_spaces(next, end);
 	}
 
-	*prefix = start + 1;
+	const char *command_end = memchr(p, ' ', end - p);
+	if (!command_end)
+		command_end = end;
+	if (command_end == p) {
+		pr_debug(0, "invalid packet: no command");
+		return -EINVAL;
+	}
+	m->command = (struct arg){ p, command_end - p };
+
+	if (m->command.len == 3 && isdigit(p[0]) && isdigit(p[1])
+			&& isdigit(p[2])) {
+		m->num = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+		m->cmd = irc_cmd_from_num(m->num);
+	} else {
+		m->cmd = irc_cmd_lookup(m->command.data, m->command.len);
+	}
+
+	p = skip_spaces(command_end, end);
+	m->remain = (struct arg){ p, end - p };
+
+	while (p < end) {
+		struct arg *a = &m->params[m->param_ct++];
+
+		/* the last parameter slot always gets the rest of the line */
+		if (*p == ':' || m->param_ct == IRC_MAX_PARAMETERS) {
+			if (*p == ':')
+				p++;
+			*a = (struct arg){ p, end - p };
+			break;
+		}
 
-	/* the pkt starts with a nick or server name */
-	char *next = memchr(start + 1, ' ', len - 1);
-	if (!next) {
-		pr_debug(0, "invalid packet: couldn't locate a space after the first ':name'");
-		return NULL;
+		const char *arg_end = memchr(p, ' ', end - p);
+		if (!arg_end)
+			arg_end = end;
+		*a = (struct arg){ p, arg_end - p };
+		p = skip_spaces(arg_end, end);
 	}
 
-	*prefix_len = next - *prefix;
+	return 0;
+}
+
+bool irc_message_tag(const struct irc_message *m,
+		const char *key, size_t key_len, struct arg *value)
+{
+	const char *p = m->tags.data;
+	const char *end = p + m->tags.len;
+
+	while (p < end) {
+		const char *tag_end = memchr(p, ';', end - p);
+		if (!tag_end)
+			tag_end = end;
+
+		const char *eq = memchr(p, '=', tag_end - p);
+		const char *key_end = eq ? eq : tag_end;
+		if (memeq(p, key_end - p, key, key_len)) {
+			if (value) {
+				if (eq)
+					*value = (struct arg){ eq + 1, tag_end - (eq + 1) };
+				else
+					*value = (struct arg){ tag_end, 0 };
+			}
+			return true;
+		}
+
+		p = tag_end + 1;
+	}
 
-	/* point to the thing after the space */
-	/* next + 1 :: skip the space we found with memchr */
-	return memnchr(next + 1, ' ', len - (next + 1 - start));
+	return false;
 }
 
-#if 0
-void irc_address_parts(const char *addr, size_t addr_len,
-		const char **nick, size_t *nick_len,
-		const char **user, size_t *user_len,
-		const char **host, size_t *host_len)
+size_t irc_tag_unescape(struct arg value, char *buf, size_t buf_len)
 {
-	const char *maybe_nick_end = memchr(addr, '!', addr_len);
-	if (maybe_nick_end) {
-		*nick = addr;
-		*nick_len = maybe_nick_end - addr;
-	} else {
-		*nick = NULL;
-		*nick_len = 0;
+	size_t i, used = 0;
+	for (i = 0; i < value.len; i++) {
+		char ch = value.data[i];
+		if (ch == '\\') {
+			/* a trailing lone '\' is dropped */
+			if (++i == value.len)
+				break;
+			switch (value.data[i]) {
+			case ':':
+				ch = ';';
+				break;
+			case 's':
+				ch = ' ';
+				break;
+			case 'r':
+				ch = '\r';
+				break;
+			case 'n':
+				ch = '\n';
+				break;
+			default:
+				/* includes "\\" */
+				ch = value.data[i];
+			}
+		}
+
+		if (used < buf_len)
+			buf[used] = ch;
+		used++;
 	}
 
-	/* FIXME: unfinished */
+	return used;
 }
-#endif
 
 bool irc_user_is_me(struct irc_connection *c, const char *start, size_t len)
 
@@ -211,16 +638,79 @@ bool irc_user_is_me(struct irc_connection *c, const char *start, size_t len)
 	return memeq(c->user, strlen(c->user), start, len);
 }
 
+static int mode_line(void *ctx, const char *chan, size_t chan_len,
+		const char *modes, size_t modes_len,
+		const char *args, size_t args_len)
+{
+	struct irc_connection *c = ctx;
+	struct arg parts[] = {
+		IRC_ARG_LIT("MODE "),
+		{ chan, chan_len },
+		IRC_ARG_LIT(" "),
+		{ modes, modes_len },
+		IRC_ARG_LIT(" "),
+		{ args, args_len },
+	};
+	return irc_cmd_spans_queue(c, parts,
+			ARRAY_SIZE(parts) - (args_len ? 0 : 2));
+}
+
+static void mode_prepare_cb(EV_P_ ev_prepare *w, int revents)
+{
+	struct irc_connection *c = container_of(w, typeof(*c), mode_prepare);
+	size_t max = c->isupport.modes ? c->isupport.modes : IRC_MODES_DEFAULT;
+
+	ev_prepare_stop(EV_A_ w);
+	irc_modeq_flush(&c->modeq, max, IRC_MAX_LINE_LENGTH, mode_line, c);
+	irc_send_run(c);
+}
+
+int irc_cmd_mode_queue(struct irc_connection *c,
+		const char *channel, size_t channel_len,
+		char sign, char mode,
+		const char *arg, size_t arg_len)
+{
+	if (irc_modeq_add(&c->modeq, channel, channel_len, sign, mode,
+				arg, arg_len)) {
+		pr_debug(1, "could not queue mode change, dropping.");
+		return -1;
+	}
+
+	if (!ev_is_active(&c->mode_prepare))
+		ev_prepare_start(c->loop, &c->mode_prepare);
+	return 0;
+}
+
+static const struct {
+	enum irc_channel_user_mode bit;
+	char mode;
+} channel_user_modes[] = {
+	{ IRC_CUM_o, 'o' },
+	{ IRC_CUM_v, 'v' },
+};
+
+static int channel_user_mode(struct irc_connection *c, char sign,
+		const char *channel, size_t channel_len,
+		const char *name, size_t name_len,
+		enum irc_channel_user_mode mode)
+{
+	size_t i;
+	int r = 0;
+	for (i = 0; i < ARRAY_SIZE(channel_user_modes); i++)
+		if ((mode & channel_user_modes[i].bit)
+				&& irc_cmd_mode_queue(c, channel, channel_len, sign,
+					channel_user_modes[i].mode, name, name_len))
+			r = -1;
+	return r;
+}
+
 int irc_set_channel_user_mode(struct irc_connection *c,
 		const char *channel, size_t channel_len,
 		const char *name, size_t name_len,
 		enum irc_channel_user_mode mode)
 {
-	if (!(mode & IRC_CUM_o))
-		return 0;
-	irc_cmd_fmt(c, "MODE %.*s +o %.*s", (int)channel_len, channel,
-			(int)name_len, name);
-	return 0;
+	return channel_user_mode(c, '+', channel, channel_len, name, name_len,
+			mode);
 }
 
 int irc_clear_channel_user_mode(struct irc_connection *c,
@@ -228,19 +718,21 @@ int irc_clear_channel_user_mode(struct irc_connection *c,
 		const char *name, size_t name_len,
 		enum irc_channel_user_mode mode)
 {
-	if (!(mode & IRC_CUM_o))
-		return 0;
-	irc_cmd_fmt(c, "MODE %.*s -o %.*s", (int)channel_len, channel,
-			(int)name_len, name);
-	return 0;
+	return channel_user_mode(c, '-', channel, channel_len, name, name_len,
+			mode);
 }
 
 int irc_cmd_invite(struct irc_connection *c,
 		char const *nick, size_t nick_len,
 		char const *chan, size_t chan_len)
 {
-	irc_cmd_fmt(c, "INVITE %.*s %.*s", (int)nick_len, nick, (int)chan_len, chan);
-	return 0;
+	struct arg parts[] = {
+		IRC_ARG_LIT("INVITE "),
+		{ nick, nick_len },
+		IRC_ARG_LIT(" "),
+		{ chan, chan_len },
+	};
+	return irc_cmd_spans(c, parts, ARRAY_SIZE(parts));
 }
 
 static uint32_t op_hash_num(unsigned num)
@@ -261,9 +753,154 @@ static uint32_t op_hash(struct irc_operation *op)
 		return op_hash_str(op->str, op->str_len);
 }
 
+enum irc_cmd irc_cmd_lookup(const char *str, size_t str_len)
+{
+	/* a switch on the length & first character leaves at most 3 fixed length
+	 * compares (covering every name in irc_cmds.h) */
+#define IS(name) \
+	if (!memcmp(str, #name, sizeof(#name) - 1)) \
+		return IRC_CMD_##name
+	switch (str_len) {
+	case 3:
+		IS(CAP);
+		break;
+	case 4:
+		switch (str[0]) {
+		case 'A': IS(AWAY); break;
+		case 'J': IS(JOIN); break;
+		case 'K': IS(KICK); IS(KILL); break;
+		case 'M': IS(MODE); break;
+		case 'N': IS(NICK); break;
+		case 'P': IS(PING); IS(PONG); IS(PART); break;
+		case 'Q': IS(QUIT); break;
+		}
+		break;
+	case 5:
+		switch (str[0]) {
+		case 'B': IS(BATCH); break;
+		case 'E': IS(ERROR); break;
+		case 'T': IS(TOPIC); break;
+		}
+		break;
+	case 6:
+		switch (str[0]) {
+		case 'I': IS(INVITE); break;
+		case 'N': IS(NOTICE); break;
+		}
+		break;
+	case 7:
+		switch (str[0]) {
+		case 'A': IS(ACCOUNT); break;
+		case 'C': IS(CHGHOST); break;
+		case 'P': IS(PRIVMSG); break;
+		case 'W': IS(WALLOPS); break;
+		}
+		break;
+	case 12:
+		IS(AUTHENTICATE);
+		break;
+	}
+#undef IS
+	return IRC_CMD_UNKNOWN;
+}
+
+enum irc_cmd irc_cmd_from_num(unsigned num)
+{
+	switch (num) {
+#define RPL(name, value) case value: return IRC_CMD_RPL_##name;
+#include "irc_spec.h"
+#undef RPL
+	default:
+		return IRC_CMD_UNKNOWN;
+	}
+}
+
+static enum irc_cmd op_cmd(struct irc_operation *op)
+{
+	if (op->type == IRC_OP_NUM)
+		return irc_cmd_from_num(op->num);
+	else
+		return irc_cmd_lookup(op->str, op->str_len);
+}
+
+static int compare_op_to_op(const void *arg_, const void *op_)
+{
+	const struct irc_operation *a = arg_;
+	const struct irc_operation *op = op_;
+
+	if (a->type != op->type)
+		return 1;
+	if (op->type == IRC_OP_NUM)
+		return a->num != op->num;
+	return !memeq(a->str, a->str_len, op->str, op->str_len);
+}
+
+static struct irc_operation *op_chain_insert(struct irc_operation *head,
+		struct irc_operation *op)
+{
+	struct irc_operation **pp = &head;
+	while (*pp && (*pp)->prio <= op->prio)
+		pp = &(*pp)->next;
+	op->next = *pp;
+	*pp = op;
+	return head;
+}
+
+static struct irc_operation *op_chain_remove(struct irc_operation *head,
+		struct irc_operation *op)
+{
+	struct irc_operation **pp = &head;
+	while (*pp && *pp != op)
+		pp = &(*pp)->next;
+	if (*pp)
+		*pp = op->next;
+	op->next = NULL;
+	return head;
+}
+
+/* the chain's head is the only op in the hash table */
+static void op_hash_replace_head(struct irc_connection *c,
+		struct irc_operation *old, struct irc_operation *new)
+{
+	if (old == new)
+		return;
+
+	uint32_t hash = op_hash(old ? old : new);
+	if (old)
+		tommy_hashlin_remove_existing(&c->operations, &old->node);
+	if (new)
+		tommy_hashlin_insert(&c->operations, &new->node, new, hash);
+}
+
 void irc_add_operation(struct irc_connection *c, struct irc_operation *op)
 {
-	tommy_hashlin_insert(&c->operations, &op->node, op, op_hash(op));
+	op->cmd = op_cmd(op);
+	op->next = NULL;
+
+	if (op->cmd) {
+		c->dispatch[op->cmd] = op_chain_insert(c->dispatch[op->cmd], op);
+		return;
+	}
+
+	struct irc_operation *head = tommy_hashlin_search(&c->operations,
+			compare_op_to_op, op, op_hash(op));
+	op_hash_replace_head(c, head, op_chain_insert(head, op));
+}
+
+void irc_remove_operation(struct irc_connection *c, struct irc_operation *op)
+{
+	if (c->op_next == op)
+		c->op_next = op->next;
+
+	if (op->cmd) {
+		c->dispatch[op->cmd] = op_chain_remove(c->dispatch[op->cmd], op);
+		return;
+	}
+
+	struct irc_operation *head = tommy_hashlin_search(&c->operations,
+			compare_op_to_op, op, op_hash(op));
+	if (head)
+		op_hash_replace_head(c, head, op_chain_remove(head, op));
 }
 
 int irc_create_operation_num(struct irc_connection *c,
@@ -297,27 +934,6 @@ int irc_create_operation_str_(struct irc_connection *c,
 	return 0;
 }
 
-/* encode state suitable for passing via an argument to a program */
-size_t irc_dump_state(struct irc_connection *c, char *buf, size_t len)
-{
-#define R (used > len ? used - len : 0)
-	size_t used = 0;
-	used += snprintf(&buf[used], R, "{.fd=%d,.server=", c->w.fd);
-	used += sprint_cstring(&buf[used], R, c->server);
-	used += snprintf(&buf[used], R, ",.port=");
-	used += sprint_cstring(&buf[used], R, c->port);
-	used += snprintf(&buf[used], R, ".buffer=");
-	used += sprint_bytes_as_cstring(&buf[used], R, c->in_buf, c->in_pos);
-	used += snprintf(&buf[used], R, "}");
-	return used;
-#undef R
-}
-
-int irc_load_state(struct irc_connection *c, const char *buf, size_t len)
-{
-	return -1;
-}
-
 static int compare_arg_to_op_str(const void *arg_, const void *op_)
 {
 	const struct arg *arg = arg_;
@@ -338,191 +954,1175 @@ static int compare_num_to_op_num(const void *num_, const void *op_)
 	return op->num != num;
 }
 
-static int process_pkt(struct irc_connection *c, char *start, size_t len)
+/* returns the last error from a handler, if any */
+static int run_ops(struct irc_connection *c, struct irc_operation *op,
+		const struct irc_message *m)
 {
-	if (!len)
-		return -EMSGSIZE;
-
-	char *prefix;
-	size_t prefix_len;
-	char *command = irc_parse_prefix(start, len, &prefix, &prefix_len);
-
-	if (!command)
-		return -EINVAL;
-
-	char *remain = memchr(command + 1, ' ', len - (command + 1 - start));
-	size_t command_len = remain - command;
-	/* skip duplicate spaces */
-	remain = memnchr(remain + 1, ' ', len - (remain + 1 - start));
-	size_t remain_len = len - (remain - start);
-
-	pr_debug(1, "prefix=\"%.*s\", command=\"%.*s\", remain=\"%.*s\"",
-			(int)prefix_len, prefix,
-			(int)command_len, command,
-			(int)remain_len, remain);
-	if (command_len == 3 && isdigit(*command)
-				&& isdigit(*(command+1))
-				&& isdigit(*(command+2))) {
-		unsigned cmd_val = (*(command) - '0') * 100
-			+ (*(command + 1) - '0') * 10
-			+ (*(command + 2) - '0');
-
-		struct irc_operation *op = tommy_hashlin_search(&c->operations,
-				compare_num_to_op_num,
-				(void *)(uintptr_t)cmd_val, op_hash_num(cmd_val));
-		if (op)
-			return op->cb(c, op, prefix, prefix_len, remain, remain_len);
+	int ret = 0;
+	/* a handler may dispatch another line */
+	struct irc_operation *outer = c->op_next;
+	while (op) {
+		/* handlers may remove themselves, or the ones after them (see
+		 * irc_remove_operation()) */
+		c->op_next = op->next;
+		int r = op->cb(c, op, m);
+		if (r)
+			ret = r;
+		/* a handler disconnected us, freeing the line @m points into */
+		if (!c->in.cap)
+			break;
+		op = c->op_next;
 	}
-
-	/* otherwise, it must be a string command */
-	struct arg s = {
-		.data = command,
-		.len  = command_len,
-	};
-	struct irc_operation *op = tommy_hashlin_search(&c->operations,
-					compare_arg_to_op_str, &s,
-					op_hash_str(command, command_len));
-	if (op)
-		return op->cb(c, op, prefix, prefix_len, remain, remain_len);
-
-	warnx("unknown command: %.*s", (int)command_len,
-			command);
-	return -EINVAL;
+	c->op_next = outer;
+	return ret;
 }
 
-/* general fmt of messages */
-/* :server_from number_status yournick :junk */
-static void conn_cb(EV_P_ ev_io *w, int revents)
+static uint64_t user_mode_bit(char m)
 {
-	struct irc_connection *c = container_of(w, typeof(*c), w);
+	if (m >= 'A' && m <= 'z')
+		return UINT64_C(1) << (m - 'A');
+	return 0;
+}
 
-	ssize_t max_read = sizeof(c->in_buf) - c->in_pos;
-	char *c_buf = c->in_buf + c->in_pos;
+static struct irc_channel *channel_find(struct irc_connection *c, struct arg name)
+{
+	struct irc_channel *ch;
+	list_for_each(&c->channels, ch, node)
+		if (memeq(ch->name, ch->name_len, name.data, name.len))
+			return ch;
+	return NULL;
+}
 
-	if (max_read <= 0)
-		warnx("buffer overflow, discarding.");
+bool irc_in_channel(struct irc_connection *c, const char *name,
+		size_t name_len)
+{
+	return channel_find(c, (struct arg){ name, name_len });
+}
 
-	ssize_t r = read(w->fd, c_buf, max_read);
-	if (r == 0) {
-		fputs("server closed link, exiting...\n", stdout);
-		ev_io_stop(EV_A_ w);
-		ev_break(EV_A_ EVBREAK_ALL);
+static void channel_joined(struct irc_connection *c, struct arg name)
+{
+	if (!name.len || channel_find(c, name))
 		return;
-	}
 
-	if (r == -1) {
-		warn("failed to read");
+	struct irc_channel *ch = malloc(sizeof(*ch) + name.len);
+	if (!ch)
 		return;
+	ch->name_len = name.len;
+	memcpy(ch->name, name.data, name.len);
+	list_add_tail(&c->channels, &ch->node);
+}
+
+static void channel_left(struct irc_connection *c, struct arg name)
+{
+	struct irc_channel *ch = channel_find(c, name);
+	if (ch) {
+		list_del(&ch->node);
+		free(ch);
 	}
+}
 
-	c->in_pos += r;
+static bool is_me(struct irc_connection *c, struct arg nick)
+{
+	return memeq(nick.data, nick.len, c->nick, c->nick_len);
+}
 
-	if (debug_is(4)) {
-		printf("R %zd ", c->in_pos);
-		print_bytes_as_cstring(c->in_buf, c->in_pos, stdout);
-		putchar('\n');
-		printf("B %zd ", c->in_pos);
-		print_bytes_as_cstring(c->in_buf, c->in_pos, stdout);
+/* the server says our nick is now @nick */
+static void nick_changed(struct irc_connection *c, struct arg nick)
+{
+	char *n = realloc(c->nick_buf, nick.len + 1);
+	if (!n) {
+		warnx("could not keep our new nick %.*s", (int)nick.len,
+				nick.data);
+		return;
+	}
+	memcpy(n, nick.data, nick.len);
+	n[nick.len] = '\0';
+
+	if (c->self_prefix_len)
+		c->self_prefix_len = c->self_prefix_len - c->nick_len + nick.len;
+	c->nick_buf = n;
+	c->nick = n;
+	c->nick_len = nick.len;
+}
+
+/* our nick, the channels we are in & our user modes, which a reconnect
+ * restores */
+static void irc_track_self(struct irc_connection *c,
+		const struct irc_message *m)
+{
+	switch (m->cmd) {
+	case IRC_CMD_JOIN:
+		if (m->param_ct && is_me(c, m->nick))
+			channel_joined(c, m->params[0]);
+		break;
+	case IRC_CMD_PART:
+		if (m->param_ct && is_me(c, m->nick)) {
+			/* "PART #a,#b" */
+			struct arg l = m->params[0];
+			while (l.len) {
+				const char *comma = memchr(l.data, ',', l.len);
+				size_t n = comma ? (size_t)(comma - l.data) : l.len;
+				channel_left(c, (struct arg){ l.data, n });
+				l.data += MIN(n + 1, l.len);
+				l.len -= MIN(n + 1, l.len);
+			}
+		}
+		break;
+	case IRC_CMD_KICK:
+		if (m->param_ct >= 2 && is_me(c, m->params[1]))
+			channel_left(c, m->params[0]);
+		break;
+	case IRC_CMD_NICK:
+		if (m->param_ct && m->params[0].len && !m->from_server
+				&& is_me(c, m->nick))
+			nick_changed(c, m->params[0]);
+		break;
+	case IRC_CMD_MODE:
+		if (m->param_ct >= 2 && is_me(c, m->params[0])) {
+			struct arg ms = m->params[1];
+			bool set = true;
+			size_t i;
+			for (i = 0; i < ms.len; i++) {
+				if (ms.data[i] == '+' || ms.data[i] == '-')
+					set = ms.data[i] == '+';
+				else if (set)
+					c->user_modes |= user_mode_bit(ms.data[i]);
+				else
+					c->user_modes &= ~user_mode_bit(ms.data[i]);
+			}
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * After a reconnect, get back our user modes and every channel we were in,
+ * all queued at once with the channels packed into as few JOINs as fit.
+ */
+static void irc_replay(struct irc_connection *c)
+{
+	if (c->user_modes) {
+		char modes[1 + 64];
+		size_t n = 0;
+		char m;
+		modes[n++] = '+';
+		for (m = 'A'; m <= 'z'; m++)
+			if (c->user_modes & user_mode_bit(m))
+				modes[n++] = m;
+
+		struct arg parts[] = {
+			IRC_ARG_LIT("MODE "),
+			{ c->nick, c->nick_len },
+			IRC_ARG_LIT(" "),
+			{ modes, n },
+		};
+		irc_cmd_spans_queue(c, parts, ARRAY_SIZE(parts));
+	}
+
+	size_t max = c->isupport.join_targets ? c->isupport.join_targets : SIZE_MAX;
+	char list[IRC_MAX_LINE_LENGTH];
+	struct arg parts[] = {
+		IRC_ARG_LIT("JOIN "),
+		{ list, 0 },
+	};
+	size_t ct = 0;
+	struct irc_channel *ch;
+	list_for_each(&c->channels, ch, node) {
+		size_t more = parts[1].len + !!ct + ch->name_len;
+		if (ct && (ct >= max || parts[0].len + more > IRC_MAX_LINE_LENGTH)) {
+			irc_cmd_spans_queue(c, parts, ARRAY_SIZE(parts));
+			parts[1].len = 0;
+			ct = 0;
+		}
+
+		if (parts[0].len + ch->name_len > IRC_MAX_LINE_LENGTH)
+			continue;
+		if (ct)
+			list[parts[1].len++] = ',';
+		memcpy(list + parts[1].len, ch->name, ch->name_len);
+		parts[1].len += ch->name_len;
+		ct++;
+	}
+	if (ct)
+		irc_cmd_spans_queue(c, parts, ARRAY_SIZE(parts));
+
+	irc_send_run(c);
+}
+
+static int lag_cookie(struct irc_connection *c, char *buf, size_t len)
+{
+	return snprintf(buf, len, "lag%x", c->ping_seq);
+}
+
+static void lag_ping(struct irc_connection *c)
+{
+	char cookie[16];
+	c->ping_seq++;
+	int len = lag_cookie(c, cookie, sizeof(cookie));
+
+	/* straight to the output queue, past the send pacing: time spent
+	 * waiting behind other lines for a token would count as lag */
+	char *line = irc_outq_reserve(&c->out, len + 8);
+	if (!line) {
+		/* try again later rather than time out on a PING never sent */
+		pr_debug(1, "could not queue PING, dropping.");
+		ev_timer_set(&c->ping_timer, c->ping_interval ? c->ping_interval
+				: IRC_PING_INTERVAL, 0);
+		ev_timer_start(c->loop, &c->ping_timer);
+		return;
+	}
+	memcpy(line, "PING :", 6);
+	memcpy(line + 6, cookie, len);
+	memcpy(line + 6 + len, "\r\n", 2);
+	irc_outq_commit(&c->out, len + 8);
+	irc_cmd_queued(c, line, len + 8);
+	irc_out_kick(c);
+
+	/* ev_time(), not the loop's cached time, so the wait to get here
+	 * isn't counted as lag */
+	c->ping_sent = ev_time();
+	c->ping_waiting = true;
+	ev_timer_set(&c->ping_timer,
+			c->ping_timeout ? c->ping_timeout : IRC_PING_TIMEOUT, 0);
+	ev_timer_start(c->loop, &c->ping_timer);
+}
+
+/* return: true if @m answers our PING */
+static bool lag_pong(struct irc_connection *c, const struct irc_message *m)
+{
+	char cookie[16];
+	if (!c->ping_waiting || !m->param_ct)
+		return false;
+	struct arg p = m->params[m->param_ct - 1];
+	if (!memeq(p.data, p.len, cookie, lag_cookie(c, cookie, sizeof(cookie))))
+		return false;
+
+	double rtt = ev_time() - c->ping_sent;
+	c->lag = rtt;
+	if (!c->lag_hist) {
+		/* only connections that check their lag pay for it */
+		c->lag_hist = malloc(sizeof(*c->lag_hist));
+		if (c->lag_hist)
+			irc_lag_hist_reset(c->lag_hist);
+	}
+	if (c->lag_hist)
+		irc_lag_hist_add(c->lag_hist, rtt);
+	c->ping_waiting = false;
+	pr_debug(2, "lag %.3fs", rtt);
+
+	double interval = c->ping_interval ? c->ping_interval
+		: IRC_PING_INTERVAL;
+	ev_timer_stop(c->loop, &c->ping_timer);
+	ev_timer_set(&c->ping_timer, rtt < interval ? interval - rtt : 0, 0);
+	ev_timer_start(c->loop, &c->ping_timer);
+	return true;
+}
+
+/* how others see us limits how much fits in a line we send */
+static void irc_learn_self(struct irc_connection *c,
+		const struct irc_message *m)
+{
+	if (m->cmd == IRC_CMD_RPL_WELCOME && m->param_ct) {
+		/* "Welcome to the Internet Relay Network nick!user@host" */
+		struct arg w = m->params[m->param_ct - 1];
+		size_t i = w.len;
+		while (i && w.data[i - 1] != ' ')
+			i--;
+		w.data += i;
+		w.len -= i;
+		if (memchr(w.data, '!', w.len) && memchr(w.data, '@', w.len))
+			c->self_prefix_len = w.len;
+
+		c->reconnect_attempts = 0;
+		irc_replay(c);
+		if (c->lag_check && !ev_is_active(&c->ping_timer))
+			lag_ping(c);
+		return;
+	}
+
+	if (!m->from_server && m->host.len
+			&& memeq(m->nick.data, m->nick.len, c->nick, c->nick_len))
+		c->self_prefix_len = m->prefix.len;
+}
+
+/* "123" -> 123, stopping at the first non-digit */
+static size_t parse_count(const char *s, size_t len)
+{
+	size_t i, v = 0;
+	for (i = 0; i < len && isdigit((unsigned char)s[i]); i++)
+		v = v * 10 + (s[i] - '0');
+	return v;
+}
+
+static void isupport_targmax(struct irc_isupport *is, struct arg v)
+{
+	const char *end = v.data + v.len;
+	const char *p = v.data;
+	while (p < end) {
+		const char *comma = memchr(p, ',', end - p);
+		const char *e = comma ? comma : end;
+		const char *colon = memchr(p, ':', e - p);
+		if (colon) {
+			/* "CMD:" means no limit */
+			size_t n = colon + 1 == e ? SIZE_MAX
+				: parse_count(colon + 1, e - colon - 1);
+			if (memeqstr(p, colon - p, "PRIVMSG"))
+				is->privmsg_targets = n;
+			else if (memeqstr(p, colon - p, "NOTICE"))
+				is->notice_targets = n;
+			else if (memeqstr(p, colon - p, "JOIN"))
+				is->join_targets = n;
+		}
+		p = e + 1;
+	}
+}
+
+/* ":server 005 nick TOKEN TOKEN=value -TOKEN :are supported by this server" */
+static void irc_learn_isupport(struct irc_connection *c,
+		const struct irc_message *m)
+{
+	struct irc_isupport *is = &c->isupport;
+	size_t i;
+	for (i = 1; i + 1 < m->param_ct; i++) {
+		struct arg t = m->params[i];
+		const char *eq = memchr(t.data, '=', t.len);
+		struct arg k = { t.data, eq ? (size_t)(eq - t.data) : t.len };
+		struct arg v = { eq ? eq + 1 : t.data + t.len,
+			eq ? t.len - k.len - 1 : 0 };
+
+		if (memeqstr(k.data, k.len, "TARGMAX")) {
+			isupport_targmax(is, v);
+		} else if (memeqstr(k.data, k.len, "MODES")) {
+			is->modes = v.len ? parse_count(v.data, v.len) : SIZE_MAX;
+		} else if (memeqstr(k.data, k.len, "MAXTARGETS")) {
+			/* TARGMAX is more specific, don't override it */
+			size_t n = v.len ? parse_count(v.data, v.len) : SIZE_MAX;
+			if (!is->privmsg_targets)
+				is->privmsg_targets = n;
+			if (!is->notice_targets)
+				is->notice_targets = n;
+		}
+	}
+}
+
+static int process_pkt(struct irc_connection *c, char *start, size_t len)
+{
+	if (!len)
+		return -EMSGSIZE;
+
+	struct irc_message m;
+	int r = irc_parse_message(&m, start, len);
+	if (r)
+		return r;
+
+	pr_debug(1, "tags=\"%.*s\", prefix=\"%.*s\", command=\"%.*s\", remain=\"%.*s\"",
+			(int)m.tags.len, m.tags.data,
+			(int)m.prefix.len, m.prefix.data,
+			(int)m.command.len, m.command.data,
+			(int)m.remain.len, m.remain.data);
+
+	irc_learn_self(c, &m);
+	irc_track_self(c, &m);
+	if (m.cmd == IRC_CMD_PONG && lag_pong(c, &m))
+		return 0;
+	if (m.cmd == IRC_CMD_RPL_ISUPPORT)
+		irc_learn_isupport(c, &m);
+
+	struct irc_operation *op = m.cmd ? c->dispatch[m.cmd] : NULL;
+	if (op)
+		return run_ops(c, op, &m);
+
+	/* custom commands and numerics */
+	if (!tommy_hashlin_count(&c->operations))
+		goto unknown;
+
+	if (m.num) {
+		op = tommy_hashlin_search(&c->operations,
+				compare_num_to_op_num,
+				(void *)(uintptr_t)m.num, op_hash_num(m.num));
+		if (op)
+			return run_ops(c, op, &m);
+	}
+
+	/* otherwise, it must be a string command */
+	op = tommy_hashlin_search(&c->operations,
+			compare_arg_to_op_str, &m.command,
+			op_hash_str(m.command.data, m.command.len));
+	if (op)
+		return run_ops(c, op, &m);
+
+unknown:
+	warnx("unknown command: %.*s", (int)m.command.len,
+			m.command.data);
+	return -EINVAL;
+}
+
+static void print_inbuf(const char *tag, struct irc_inbuf *in)
+{
+	struct iovec iov[2];
+	int i, ct = irc_inbuf_data(in, iov);
+	printf("%s %zu ", tag, in->len);
+	for (i = 0; i < ct; i++)
+		print_bytes_as_cstring(iov[i].iov_base, iov[i].iov_len, stdout);
+	putchar('\n');
+}
+
+static void conn_line(void *ctx, char *start, size_t len)
+{
+	struct irc_connection *c = ctx;
+	int r = process_pkt(c, start, len);
+	if (r) {
+		printf("> %zd ", len);
+		print_bytes_as_cstring(start, len, stdout);
 		putchar('\n');
 	}
+}
+
+static void conn_connector_free(struct irc_connection *c)
+{
+	if (!c->connector)
+		return;
+	irc_connector_cancel(c->connector);
+	free(c->connector);
+	c->connector = NULL;
+}
+
+/* drop everything tied to the link, keeping what is replayed on reconnect */
+static void conn_reset(EV_P_ struct irc_connection *c)
+{
+	irc_dns_cancel(&c->dns);
+	conn_connector_free(c);
+
+	ev_timer_stop(EV_A_ &c->send_timer);
+	ev_prepare_stop(EV_A_ &c->mode_prepare);
+	ev_timer_stop(EV_A_ &c->ping_timer);
+	c->ping_waiting = false;
+	c->lag = -1;
+
+	if (c->fd >= 0) {
+		c->io->detach(c);
+		close(c->fd);
+		c->fd = -1;
+	}
+
+	irc_inbuf_free(&c->in);
+	irc_outq_free(&c->out);
+	irc_sched_free(&c->sched);
+	irc_modeq_free(&c->modeq);
+
+	c->self_prefix_len = 0;
+	c->isupport = (struct irc_isupport) {};
+}
+
+static void irc_reconnect_later(struct irc_connection *c)
+{
+	/* per thread, connections may run on several (see irc_runtime) */
+	static __thread unsigned short seed[3];
+	static __thread bool seeded;
+	if (!seeded) {
+		long s = time(NULL) ^ getpid() ^ (long)seed;
+		memcpy(seed, &s, sizeof(seed));
+		seeded = true;
+	}
+
+	double min = c->reconnect_min ? c->reconnect_min : IRC_RECONNECT_MIN;
+	double max = c->reconnect_max ? c->reconnect_max : IRC_RECONNECT_MAX;
+	double delay = min;
+	unsigned i;
+	for (i = 0; i < c->reconnect_attempts && delay < max; i++)
+		delay *= 2;
+	if (delay > max)
+		delay = max;
+
+	/* half of it random, so clients dropped together don't all return at
+	 * the same moment */
+	delay = delay / 2 + erand48(seed) * delay / 2;
+	c->reconnect_attempts++;
+
+	pr_debug(1, "reconnecting in %.2fs", delay);
+	ev_timer_set(&c->reconnect_timer, delay, 0);
+	ev_timer_start(c->loop, &c->reconnect_timer);
+}
+
+static void reconnect_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct irc_connection *c = container_of(w, typeof(*c), reconnect_timer);
+	pr_debug(1, "reconnecting to %s:%s", c->server, c->port);
+	if (irc_connect(c))
+		irc_reconnect_later(c);
+}
+
+/* connecting failed before we had a link */
+static void conn_failed(struct irc_connection *c)
+{
+	if (c->reconnect)
+		irc_reconnect_later(c);
+}
+
+static void conn_closed(EV_P_ struct irc_connection *c)
+{
+	conn_reset(EV_A_ c);
+	if (c->reconnect) {
+		warnx("server closed link, reconnecting");
+		irc_reconnect_later(c);
+		return;
+	}
+
+	/* only this connection is affected, the loop keeps running anything
+	 * else it has */
+	if (c->on_close) {
+		c->on_close(c);
+	} else {
+		warnx("server closed link");
+	}
+}
+
+static void ping_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct irc_connection *c = container_of(w, typeof(*c), ping_timer);
+	if (!c->ping_waiting) {
+		lag_ping(c);
+		return;
+	}
+
+	/* whatever else we've heard, the server isn't answering us */
+	warnx("no reply to PING in %.1fs, dropping the link", ev_now(EV_A)
+			- c->ping_sent);
+	conn_closed(EV_A_ c);
+}
+
+/*
+ * Dispatch buffered lines and read more of them.
+ *
+ * In blocking mode a single read is done. In non-blocking mode we keep
+ * reading until the socket runs dry or this wakeup's budget is used up, in
+ * which case the rest is picked up in a later loop iteration so other
+ * watchers get a turn.
+ */
+static void conn_drain(EV_P_ struct irc_connection *c)
+{
+	size_t lines = SIZE_MAX, bytes = SIZE_MAX;
+	if (c->nonblock) {
+		lines = c->read_budget_lines ? c->read_budget_lines
+			: IRC_READ_BUDGET_LINES;
+		bytes = c->read_budget_bytes ? c->read_budget_bytes
+			: IRC_READ_BUDGET_BYTES;
+	}
+
+	/* whatever didn't fit in the last budget goes first */
+	lines -= irc_inbuf_lines(&c->in, lines, conn_line, c);
+	/* a handler disconnected us */
+	if (c->fd < 0)
+		return;
 
-	char *end   = memmem(c_buf, r, "\r\n", 2);
-	char *start = c->in_buf;
-	size_t buf_len = c->in_pos;
 	for (;;) {
-		if (!end)
+		if (!lines || !bytes)
+			goto out_of_budget;
+
+		struct iovec iov[2];
+		int iov_ct = irc_inbuf_prepare(&c->in,
+				c->in_max ? c->in_max : IRC_IN_BUF_MAX, iov);
+		if (iov_ct < 0) {
+			warnx("could not allocate input buffer");
 			break;
+		}
 
-		size_t len = end - start;
+		ssize_t r = readv(c->fd, iov, iov_ct);
+		if (r == 0) {
+			conn_closed(EV_A_ c);
+			return;
+		}
 
-		r = process_pkt(c, start, len);
-		if (r) {
-			printf("> %zd ", len);
-			print_bytes_as_cstring(start, len, stdout);
-			putchar('\n');
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				warn("failed to read");
+			break;
 		}
 
-		start = end + 2;
-		buf_len -= len + 2;
-		end = memmem(start, buf_len, "\r\n", 2);
+		irc_inbuf_commit(&c->in, r);
+		bytes -= MIN((size_t)r, bytes);
+
+		if (debug_is(4))
+			print_inbuf("R", &c->in);
+
+		lines -= irc_inbuf_lines(&c->in, lines, conn_line, c);
+		if (c->fd < 0)
+			return;
+
+		if (debug_is(4))
+			print_inbuf("B", &c->in);
+
+		if (!c->nonblock)
+			break;
 	}
 
-	memmove(c->in_buf, start, buf_len);
-	c->in_pos = buf_len;
+	/* idle connections shouldn't each hold an input buffer */
+	irc_inbuf_release(&c->in);
 
-	if (debug_is(4)) {
-		printf("B %zd ", c->in_pos);
-		print_bytes_as_cstring(c->in_buf, c->in_pos, stdout);
-		putchar('\n');
+	if (ev_is_active(&c->resume_check)) {
+		ev_idle_stop(EV_A_ &c->resume_idle);
+		ev_check_stop(EV_A_ &c->resume_check);
+		ev_io_start(EV_A_ &c->w);
+	}
+	return;
+
+out_of_budget:
+	if (!ev_is_active(&c->resume_check)) {
+		ev_io_stop(EV_A_ &c->w);
+		ev_check_start(EV_A_ &c->resume_check);
+		ev_idle_start(EV_A_ &c->resume_idle);
+	}
+}
+
+int irc_io_prepare(struct irc_connection *c, struct iovec iov[2])
+{
+	return irc_inbuf_prepare(&c->in,
+			c->in_max ? c->in_max : IRC_IN_BUF_MAX, iov);
+}
+
+void irc_io_commit(struct irc_connection *c, size_t len)
+{
+	irc_inbuf_commit(&c->in, len);
+	irc_inbuf_lines(&c->in, SIZE_MAX, conn_line, c);
+}
+
+void irc_io_read_done(struct irc_connection *c)
+{
+	irc_inbuf_release(&c->in);
+}
+
+int irc_feed(struct irc_connection *c, const char *data, size_t len)
+{
+	while (len) {
+		struct iovec iov[2];
+		int i, iov_ct = irc_io_prepare(c, iov);
+		if (iov_ct < 0)
+			return -1;
+
+		for (i = 0; i < iov_ct && len; i++) {
+			size_t n = MIN(len, iov[i].iov_len);
+			memcpy(iov[i].iov_base, data, n);
+			irc_inbuf_commit(&c->in, n);
+			data += n;
+			len -= n;
+		}
+
+		irc_inbuf_lines(&c->in, SIZE_MAX, conn_line, c);
+		/* a handler disconnected us, the rest is stale */
+		if (!c->in.cap)
+			break;
+	}
+
+	irc_inbuf_release(&c->in);
+	return 0;
+}
+
+/* general fmt of messages */
+/* :server_from number_status yournick :junk */
+static void conn_cb(EV_P_ ev_io *w, int revents)
+{
+	struct irc_connection *c = container_of(w, typeof(*c), w);
+	conn_drain(EV_A_ c);
+}
+
+/* everything queued since the last iteration goes out in one writev() */
+static void write_cb(EV_P_ ev_io *w, int revents)
+{
+	struct irc_connection *c = container_of(w, typeof(*c), ww);
+	ssize_t r = irc_outq_flush(&c->out, w->fd);
+	if (r < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+		warn("failed to write, dropping %zu queued bytes", c->out.len);
+		irc_outq_free(&c->out);
 	}
+
+	if (!c->out.len)
+		ev_io_stop(EV_A_ w);
+}
+
+/* only here to keep the loop from blocking while resume_check has work */
+static void resume_idle_cb(EV_P_ ev_idle *w, int revents)
+{
+}
+
+static void resume_check_cb(EV_P_ ev_check *w, int revents)
+{
+	struct irc_connection *c = container_of(w, typeof(*c), resume_check);
+	conn_drain(EV_A_ c);
 }
 
 int irc_cmd_join(struct irc_connection *c,
 		char const *name, size_t name_len)
 {
-	return irc_cmd_fmt(c, "JOIN %.*s", (int)name_len, name);
+	struct arg parts[] = {
+		IRC_ARG_LIT("JOIN "),
+		{ name, name_len },
+	};
+	return irc_cmd_spans(c, parts, ARRAY_SIZE(parts));
 }
 
 bool irc_is_connected(struct irc_connection *c)
 {
-	return ev_is_active(&c->w);
+	return c->fd >= 0 && c->io->active(c);
 }
 
 static void irc_proto_connect(struct irc_connection *c)
 {
-	if (c->pass)
-		irc_cmd_fmt(c, "PASS %s", c->pass);
-	irc_cmd_fmt(c, "NICK %s", c->nick);
-	irc_cmd_fmt(c, "USER %s hostname servername :%s",
-			c->user, c->realname);
+	if (c->pass) {
+		struct arg pass[] = {
+			IRC_ARG_LIT("PASS "),
+			{ c->pass, strlen(c->pass) },
+		};
+		irc_cmd_spans(c, pass, ARRAY_SIZE(pass));
+	}
+
+	struct arg nick[] = {
+		IRC_ARG_LIT("NICK "),
+		{ c->nick, strlen(c->nick) },
+	};
+	irc_cmd_spans(c, nick, ARRAY_SIZE(nick));
+
+	struct arg user[] = {
+		IRC_ARG_LIT("USER "),
+		{ c->user, strlen(c->user) },
+		IRC_ARG_LIT(" hostname servername :"),
+		{ c->realname, strlen(c->realname) },
+	};
+	irc_cmd_spans(c, user, ARRAY_SIZE(user));
 }
 
-/*
- * return:
- *	a non-negative file descriptor on success
- *	-1 if dns resolution failed
- *	-2 if connection failed
- */
-static int irc_net_connect(struct irc_connection *c)
+static void conn_connected(struct irc_connector *k, int fd)
 {
-	/* TODO: use cached dns info? */
-	struct addrinfo *res = net_client_lookup(c->server, c->port,
-			AF_INET, SOCK_STREAM);
-	if (!res)
-		return -1;
+	struct irc_connection *c = k->data;
+	/* done with it, before anything below starts another connect */
+	conn_connector_free(c);
+	if (fd < 0) {
+		warnx("could not connect to %s:%s", c->server, c->port);
+		conn_failed(c);
+		return;
+	}
 
-	int fd = net_connect(res);
-	if (fd == -1)
-		return -2;
+	irc_connect_fd(c, fd);
+}
+
+static void conn_resolved(struct irc_dns_query *q, const struct addrinfo *res)
+{
+	struct irc_connection *c = container_of(q, typeof(*c), dns);
+	if (!res) {
+		warnx("could not resolve %s", c->server);
+		conn_failed(c);
+		return;
+	}
+
+	/* it's a couple of KiB, only needed until we are connected */
+	c->connector = calloc(1, sizeof(*c->connector));
+	if (!c->connector) {
+		warnx("could not connect to %s:%s", c->server, c->port);
+		conn_failed(c);
+		return;
+	}
+	c->connector->data = c;
+
+	if (irc_connector_start(c->loop, c->connector, res, conn_connected)) {
+		warnx("no usable address for %s", c->server);
+		conn_connector_free(c);
+		conn_failed(c);
+	}
+}
+
+static int ev_io_attach(struct irc_connection *c)
+{
+	/* whatever the read mode, a full socket must not block the loop in
+	 * write_cb() */
+	int fl = fcntl(c->fd, F_GETFL);
+	if (fl == -1 || fcntl(c->fd, F_SETFL, fl | O_NONBLOCK) == -1)
+		warn("could not make fd %d non-blocking", c->fd);
+
+	ev_io_set(&c->w, c->fd, EV_READ);
+	ev_io_set(&c->ww, c->fd, EV_WRITE);
+	ev_io_start(c->loop, &c->w);
+	return 0;
+}
+
+static void ev_io_detach(struct irc_connection *c)
+{
+	ev_io_stop(c->loop, &c->w);
+	ev_io_stop(c->loop, &c->ww);
+	ev_idle_stop(c->loop, &c->resume_idle);
+	ev_check_stop(c->loop, &c->resume_check);
+	ev_io_set(&c->w, -1, EV_READ);
+	ev_io_set(&c->ww, -1, EV_WRITE);
+}
 
-	freeaddrinfo(res);
+static void ev_io_kick(struct irc_connection *c)
+{
+	if (!ev_is_active(&c->ww))
+		ev_io_start(c->loop, &c->ww);
+}
 
-	return fd;
+static bool ev_io_active(struct irc_connection *c)
+{
+	return ev_is_active(&c->w) || ev_is_active(&c->resume_check);
 }
 
-static void irc_ev_init(struct irc_connection *c, int fd)
+const struct irc_io_ops irc_io_ev = {
+	.name = "ev",
+	.attach = ev_io_attach,
+	.detach = ev_io_detach,
+	.kick = ev_io_kick,
+	.active = ev_io_active,
+};
+
+void irc_io_closed(struct irc_connection *c)
 {
-	/* FIXME: avoid depending on libev */
-	ev_io_init(&c->w, conn_cb, fd, EV_READ);
-	ev_io_start(EV_DEFAULT_ &c->w);
+	conn_closed(c->loop, c);
 }
 
 void irc_init(struct irc_connection *c)
 {
+	if (!c->loop)
+		c->loop = EV_DEFAULT;
+	if (!c->io)
+		c->io = &irc_io_ev;
+	c->fd = -1;
+	c->io_priv = NULL;
+	c->connector = NULL;
+
+	memset(c->dispatch, 0, sizeof(c->dispatch));
+	c->op_next = NULL;
+	c->nick_buf = NULL;
 	tommy_hashlin_init(&c->operations);
+	irc_inbuf_init(&c->in);
+	irc_outq_init(&c->out);
+	ev_io_init(&c->w, conn_cb, -1, EV_READ);
+	ev_io_init(&c->ww, write_cb, -1, EV_WRITE);
+	ev_idle_init(&c->resume_idle, resume_idle_cb);
+	ev_check_init(&c->resume_check, resume_check_cb);
+
+	if (c->send_rate < 0)
+		irc_sched_init(&c->sched, 0, 1);
+	else
+		irc_sched_init(&c->sched,
+				c->send_rate ? c->send_rate : IRC_SEND_RATE,
+				c->send_burst ? c->send_burst : IRC_SEND_BURST);
+	ev_timer_init(&c->send_timer, send_timer_cb, 0, 0);
+
+	irc_modeq_init(&c->modeq);
+	ev_prepare_init(&c->mode_prepare, mode_prepare_cb);
+
+	list_head_init(&c->channels);
+	ev_timer_init(&c->reconnect_timer, reconnect_cb, 0, 0);
+
+	ev_timer_init(&c->ping_timer, ping_timer_cb, 0, 0);
+	c->ping_waiting = false;
+	c->lag = -1;
+	c->lag_hist = NULL;
 }
 
 void irc_connect_fd(struct irc_connection *c, int fd)
 {
-	irc_ev_init(c, fd);
+	c->fd = fd;
+	if (c->io->attach(c)) {
+		conn_closed(c->loop, c);
+		return;
+	}
+	if (c->out.len)
+		irc_out_kick(c);
 	irc_proto_connect(c);
 }
 
+void irc_disconnect(struct irc_connection *c)
+{
+	conn_reset(c->loop, c);
+	ev_timer_stop(c->loop, &c->reconnect_timer);
+	c->reconnect_attempts = 0;
+	c->user_modes = 0;
+
+	struct irc_channel *ch, *next;
+	list_for_each_safe(&c->channels, ch, next, node) {
+		list_del(&ch->node);
+		free(ch);
+	}
+}
+
+/* where the next part of irc_dump_state() goes, and how much room is left */
+#define DUMP_AT(d) ((d)->used < (d)->len ? (d)->buf + (d)->used : NULL), \
+	((d)->used < (d)->len ? (d)->len - (d)->used : 0)
+
+struct state_dump {
+	char *buf;
+	size_t len;
+	size_t used;
+};
+
+static void dump_str(struct state_dump *d, const char *name, const char *s)
+{
+	d->used += snprintf(DUMP_AT(d), ",.%s=", name);
+	d->used += sprint_cstring(DUMP_AT(d), s);
+}
+
+static void dump_uint(struct state_dump *d, const char *name, uintmax_t v)
+{
+	d->used += snprintf(DUMP_AT(d), ",.%s=%ju", name, v);
+}
+
+static void dump_queued(void *ctx, const char *line, size_t len)
+{
+	struct state_dump *d = ctx;
+	d->used += snprintf(DUMP_AT(d), ",.queued=");
+	d->used += sprint_bytes_as_cstring(DUMP_AT(d), line, len);
+}
+
+size_t irc_dump_state(struct irc_connection *c, char *buf, size_t len)
+{
+	/* anything else has state of its own on top of the fd */
+	if (c->fd < 0 || c->io != &irc_io_ev)
+		return 0;
+
+	struct state_dump d = { .buf = buf, .len = len };
+	d.used += snprintf(DUMP_AT(&d), "{.fd=%d", c->fd);
+	dump_str(&d, "server", c->server);
+	dump_str(&d, "port", c->port);
+	dump_str(&d, "nick", c->nick);
+	dump_str(&d, "user", c->user);
+	dump_str(&d, "realname", c->realname);
+
+	dump_uint(&d, "user_modes", c->user_modes);
+	dump_uint(&d, "self_prefix_len", c->self_prefix_len);
+	dump_uint(&d, "privmsg_targets", c->isupport.privmsg_targets);
+	dump_uint(&d, "notice_targets", c->isupport.notice_targets);
+	dump_uint(&d, "join_targets", c->isupport.join_targets);
+	dump_uint(&d, "modes", c->isupport.modes);
+
+	struct irc_channel *ch;
+	list_for_each(&c->channels, ch, node) {
+		d.used += snprintf(DUMP_AT(&d), ",.channel=");
+		d.used += sprint_bytes_as_cstring(DUMP_AT(&d),
+				ch->name, ch->name_len);
+	}
+
+	/* adjacent strings, like C */
+	struct iovec iov[2];
+	int i, ct = irc_inbuf_data(&c->in, iov);
+	d.used += snprintf(DUMP_AT(&d), ",.buffer=");
+	if (!ct)
+		d.used += sprint_bytes_as_cstring(DUMP_AT(&d), "", 0);
+	for (i = 0; i < ct; i++)
+		d.used += sprint_bytes_as_cstring(DUMP_AT(&d),
+				iov[i].iov_base, iov[i].iov_len);
+
+	/* may start part way through a line, so it goes out as is */
+	const struct irc_oblock *b;
+	d.used += snprintf(DUMP_AT(&d), ",.out=");
+	if (!c->out.len)
+		d.used += sprint_bytes_as_cstring(DUMP_AT(&d), "", 0);
+	for (b = c->out.first; b; b = b->next)
+		d.used += sprint_bytes_as_cstring(DUMP_AT(&d),
+				b->data + b->head, b->tail - b->head);
+
+	irc_sched_for_each(&c->sched, dump_queued, &d);
+
+	d.used += snprintf(DUMP_AT(&d), "}");
+	return d.used;
+}
+#undef DUMP_AT
+
+struct state_load {
+	struct c_ilz_ctx i;
+	struct irc_connection *c;
+	int fd;
+};
+
+static int load_uint(struct c_ilz_ctx *i, const char *id, size_t id_len,
+		uintmax_t v)
+{
+	struct state_load *l = container_of(i, struct state_load, i);
+	struct irc_connection *c = l->c;
+
+	if (memeqstr(id, id_len, "fd"))
+		l->fd = v > INT_MAX ? -1 : (int)v;
+	else if (memeqstr(id, id_len, "user_modes"))
+		c->user_modes = v;
+	else if (memeqstr(id, id_len, "self_prefix_len"))
+		c->self_prefix_len = v;
+	else if (memeqstr(id, id_len, "privmsg_targets"))
+		c->isupport.privmsg_targets = v;
+	else if (memeqstr(id, id_len, "notice_targets"))
+		c->isupport.notice_targets = v;
+	else if (memeqstr(id, id_len, "join_targets"))
+		c->isupport.join_targets = v;
+	else if (memeqstr(id, id_len, "modes"))
+		c->isupport.modes = v;
+	else
+		pr_debug(1, "state: ignoring .%.*s", (int)id_len, id);
+	return 0;
+}
+
+static int load_cstr(const char **dst, const char *str, size_t len)
+{
+	if (memchr(str, '\0', len))
+		return -1;
+	char *s = malloc(len + 1);
+	if (!s)
+		return -1;
+	memcpy(s, str, len);
+	s[len] = '\0';
+	*dst = s;
+	return 0;
+}
+
+static int load_input(struct irc_connection *c, const char *str, size_t len)
+{
+	while (len) {
+		struct iovec iov[2];
+		int i, ct = irc_inbuf_prepare(&c->in,
+				c->in_max ? c->in_max : IRC_IN_BUF_MAX, iov);
+		if (ct < 0)
+			return -1;
+		for (i = 0; i < ct && len; i++) {
+			size_t n = MIN(len, iov[i].iov_len);
+			memcpy(iov[i].iov_base, str, n);
+			irc_inbuf_commit(&c->in, n);
+			str += n;
+			len -= n;
+		}
+	}
+	return 0;
+}
+
+static int load_output(struct irc_connection *c, const char *str, size_t len)
+{
+	while (len) {
+		struct iovec iov = { (void *)str, MIN(len, IRC_OUTQ_BLOCK) };
+		if (irc_outq_append(&c->out, &iov, 1))
+			return -1;
+		str += iov.iov_len;
+		len -= iov.iov_len;
+	}
+	return 0;
+}
+
+static int load_string(struct c_ilz_ctx *i, const char *id, size_t id_len,
+		const char *str, size_t len)
+{
+	struct state_load *l = container_of(i, struct state_load, i);
+	struct irc_connection *c = l->c;
+
+	if (memeqstr(id, id_len, "server"))
+		return load_cstr(&c->server, str, len);
+	if (memeqstr(id, id_len, "port"))
+		return load_cstr(&c->port, str, len);
+	if (memeqstr(id, id_len, "user"))
+		return load_cstr(&c->user, str, len);
+	if (memeqstr(id, id_len, "realname"))
+		return load_cstr(&c->realname, str, len);
+	if (memeqstr(id, id_len, "nick")) {
+		c->nick_len = len;
+		return load_cstr(&c->nick, str, len);
+	}
+	if (memeqstr(id, id_len, "channel")) {
+		channel_joined(c, (struct arg){ str, len });
+		return 0;
+	}
+	if (memeqstr(id, id_len, "buffer"))
+		return load_input(c, str, len);
+	if (memeqstr(id, id_len, "out"))
+		return load_output(c, str, len);
+	/* reclassified by irc_cmd(), & paced from scratch */
+	if (memeqstr(id, id_len, "queued"))
+		return irc_cmd(c, str, len);
+
+	pr_debug(1, "state: ignoring .%.*s", (int)id_len, id);
+	return 0;
+}
+
+int irc_load_state(struct irc_connection *c, const char *buf, size_t len)
+{
+	struct state_load l = {
+		.i = {
+			.parse_uint = load_uint,
+			.parse_string = load_string,
+		},
+		.c = c,
+		.fd = -1,
+	};
+
+	/* nothing is sent until the fd is attached below */
+	ssize_t r = parse_struct(&l.i, buf, len);
+	if (r < 0 || l.fd < 0) {
+		warnx("could not load state");
+		return -1;
+	}
+
+	c->fd = l.fd;
+	if (c->io->attach(c))
+		return -1;
+	if (c->out.len)
+		irc_out_kick(c);
+	irc_send_run(c);
+
+	/* complete lines read by the last process but not yet handled */
+	irc_inbuf_lines(&c->in, SIZE_MAX, conn_line, c);
+	if (c->fd >= 0 && c->lag_check)
+		lag_ping(c);
+	return 0;
+}
+
+void irc_registry_init(struct irc_registry *r)
+{
+	list_head_init(&r->conns);
+	r->ct = 0;
+}
+
+void irc_registry_add(struct irc_registry *r, struct irc_connection *c)
+{
+	list_add_tail(&r->conns, &c->reg_node);
+	c->reg = r;
+	r->ct++;
+}
+
+void irc_registry_remove(struct irc_connection *c)
+{
+	if (!c->reg)
+		return;
+	list_del(&c->reg_node);
+	c->reg->ct--;
+	c->reg = NULL;
+}
+
+struct irc_connection *irc_registry_find(struct irc_registry *r,
+		const char *nick, size_t nick_len)
+{
+	struct irc_connection *c;
+	irc_registry_for_each(r, c)
+		if (memeq(c->nick, c->nick_len, nick, nick_len))
+			return c;
+	return NULL;
+}
+
+size_t irc_registry_connected(struct irc_registry *r)
+{
+	struct irc_connection *c;
+	size_t n = 0;
+	irc_registry_for_each(r, c)
+		n += irc_is_connected(c);
+	return n;
+}
+
+void irc_registry_disconnect_all(struct irc_registry *r)
+{
+	struct irc_connection *c;
+	irc_registry_for_each(r, c)
+		irc_disconnect(c);
+}
+
 int irc_connect(struct irc_connection *c)
 {
-	int fd = irc_net_connect(c);
-	if (fd < 0)
-		return fd;
-	irc_connect_fd(c, fd);
-	return fd;
+	return irc_dns_resolve(c->loop, &c->dns, c->server, c->port,
+			AF_UNSPEC, conn_resolved);
 }
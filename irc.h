@@ -5,12 +5,23 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 #include <ccan/compiler/compiler.h>
+#include <ccan/list/list.h>
 #include <tommyds/tommyhashlin.h>
 
 #include <ev.h>
 
+#include "irc_inbuf.h"
+#include "irc_outq.h"
+#include "irc_sched.h"
+#include "irc_modeq.h"
+#include "irc_dns.h"
+#include "irc_connector.h"
+#include "irc_io.h"
+#include "irc_lag.h"
+
 enum irc_num_cmds {
 #define RPL(name, value) RPL_##name = value,
 #include "irc_spec.h"
@@ -23,14 +34,50 @@ static const char * const irc_num_cmds[] = {
 #undef RPL
 };
 
+/* RFC 2812's RPL_BOUNCE, which servers have since reused for RPL_ISUPPORT */
+#define RPL_ISUPPORT RPL_BOUNCE
+#define IRC_CMD_RPL_ISUPPORT IRC_CMD_RPL_BOUNCE
+
+/*
+ * Commands and numerics that get a slot in each connection's dispatch table,
+ * so looking up their handlers doesn't involve hashing. Anything else goes
+ * through the hash table in irc_connection.operations.
+ */
+enum irc_cmd {
+	IRC_CMD_UNKNOWN,
+#define CMD(name) IRC_CMD_##name,
+#include "irc_cmds.h"
+#undef CMD
+#define RPL(name, value) IRC_CMD_RPL_##name,
+#include "irc_spec.h"
+#undef RPL
+	IRC_CMD_CT
+};
+
 /* from RFC 2812 */
 enum irc_proto {
 	IRC_MAX_SERVER_NAME_LENGTH = 63,
 	IRC_MAX_NICK_LENGTH = 9, /* clients should accept longer */
 	IRC_MAX_PARAMETERS = 15,
 	IRC_MAX_LINE_LENGTH = 510,
+	/* IRCv3 message-tags, including the '@' and trailing space */
+	IRC_MAX_TAGS_LENGTH = 8191,
 };
 
+/* what "!~user@host" could take up, until the server tells us */
+#define IRC_USER_HOST_MAX (2 + 10 + 1 + IRC_MAX_SERVER_NAME_LENGTH)
+
+/* default limit on buffered input, room for a tagged line and then some */
+#define IRC_IN_BUF_MAX 16384
+
+/* seconds to wait before reconnecting, doubling with each failure */
+#define IRC_RECONNECT_MIN 1.
+#define IRC_RECONNECT_MAX 300.
+
+/* default work done per wakeup in non-blocking mode */
+#define IRC_READ_BUDGET_LINES 256
+#define IRC_READ_BUDGET_BYTES (64 * 1024)
+
 enum irc_user_mode {
 	IRC_UM_i = 1 << 0,
 	IRC_UM_w = 1 << 1,
@@ -52,12 +99,47 @@ struct arg {
 	size_t len;
 };
 
+/* a struct arg for a string literal */
+#define IRC_ARG_LIT(str) { str, sizeof(str) - 1 }
+
+/*
+ * A message as handed to callbacks. It is split up once when it arrives, all
+ * the spans point into the connection's input buffer and are only valid for
+ * the duration of the callback.
+ */
+struct irc_message {
+	/* everything between the leading '@' and the following space, still
+	 * encoded. Use irc_message_tag() to pick out a tag. */
+	struct arg tags;
+	/* the prefix without the leading ':', empty if none was sent */
+	struct arg prefix;
+	/*
+	 * and split up. For users, "nick!user@host" (user and host may be
+	 * empty). For servers, and for messages without a prefix (which come
+	 * from the server we are connected to), only host is set.
+	 */
+	struct arg nick;
+	struct arg user;
+	struct arg host;
+	bool from_server;
+	struct arg command;
+	/* for numeric replies, the value of the command. 0 otherwise. */
+	unsigned num;
+	/* IRC_CMD_UNKNOWN for anything not in irc_cmds.h or irc_spec.h */
+	enum irc_cmd cmd;
+
+	/* all the parameters, unsplit */
+	struct arg remain;
+	/* and split. A trailing parameter has its ':' removed */
+	size_t param_ct;
+	struct arg params[IRC_MAX_PARAMETERS];
+};
+
 struct irc_connection;
 struct irc_operation;
 
 typedef int (*irc_op_cb)(struct irc_connection *c, struct irc_operation *op,
-		const char *prefix, size_t prefix_len,
-		const char *start, size_t len);
+		const struct irc_message *m);
 
 struct irc_operation {
 	tommy_node node;
@@ -73,17 +155,78 @@ struct irc_operation {
 		unsigned num;
 	};
 	irc_op_cb cb;
+	/* every handler for a command runs, lowest prio first. Handlers with
+	 * equal prio run in the order they were added. */
+	int prio;
+
+	/* filled in by irc_add_operation() */
+	enum irc_cmd cmd;
+	struct irc_operation *next;
 	/* XXX: we probably need a destructor */
 };
 
+struct irc_channel {
+	struct list_node node;
+	size_t name_len;
+	char name[];
+};
+
+/* limits the server advertised in RPL_ISUPPORT */
+struct irc_isupport {
+	/* targets allowed in one PRIVMSG/NOTICE, from TARGMAX or MAXTARGETS.
+	 * 0 if never advertised, SIZE_MAX if there is no limit. */
+	size_t privmsg_targets;
+	size_t notice_targets;
+	size_t join_targets;
+	/* parameter modes allowed in one MODE, 0 if never advertised */
+	size_t modes;
+};
+
+struct irc_registry;
+
 #define SLM(id, str) .id = str, .id##_len = strlen(str)
 struct irc_connection {
-	/* we read/write over a fd */
+	/* the loop everything for this connection runs on, EV_DEFAULT if
+	 * left NULL when irc_init() is called */
+	struct ev_loop *loop;
+
+	/* called when the server closes the link, unless we are going to
+	 * reconnect. Only this connection has been torn down. */
+	void (*on_close)(struct irc_connection *c);
+
+	/* see struct irc_registry */
+	struct irc_registry *reg;
+	struct list_node reg_node;
+
+	/* the socket to the server, -1 while not connected */
+	int fd;
+	/* how it is read & written, irc_io_ev if left NULL */
+	const struct irc_io_ops *io;
+	/* the backend's own, per connection */
+	void *io_priv;
+
+	/* irc_io_ev reads & writes the fd with these */
 	ev_io w;
+	/* active while there is queued output */
+	ev_io ww;
+
+	/* irc_io_ev always makes the fd non-blocking. When set, each wakeup
+	 * reads until it would block, or until read_budget_{lines,bytes} (0
+	 * for the IRC_READ_BUDGET_* defaults) have been dispatched, instead of
+	 * reading once. The rest is resumed from resume_check on the next loop
+	 * iteration. */
+	bool nonblock;
+	size_t read_budget_lines;
+	size_t read_budget_bytes;
+	ev_idle resume_idle;
+	ev_check resume_check;
 
 	/* network connection */
 	const char *server;
 	const char *port;
+	struct irc_dns_query dns;
+	/* only while connecting, NULL otherwise */
+	struct irc_connector *connector;
 
 	/* irc proto connection */
 	const char *nick;
@@ -92,27 +235,117 @@ struct irc_connection {
 	const char *pass;
 
 	size_t nick_len;
-
-	/* (struct irc_operation *) */
+	/* once the server changes our nick, nick points here (malloc()ed, the
+	 * caller's to free() with @c) */
+	char *nick_buf;
+
+	/* length of the "nick!user@host" others see our messages from, 0 until
+	 * we learn it from RPL_WELCOME or one of our own messages */
+	size_t self_prefix_len;
+	struct irc_isupport isupport;
+
+	/* handler chains for known commands, indexed by enum irc_cmd */
+	struct irc_operation *dispatch[IRC_CMD_CT];
+	/* (struct irc_operation *), the head of the chain for everything else */
 	tommy_hashlin operations;
+	/* the handler run after the current one, moved on if it is removed */
+	struct irc_operation *op_next;
 
-#if 0
-	/* state while connected */
-	enum irc_user_mode user_mode;
+	/* state while connected, replayed after a reconnect. user_modes has
+	 * bit (c - 'A') set for each of our user modes. */
+	uint64_t user_modes;
+	/* struct irc_channel, the channels we are in */
 	struct list_head channels;
-#endif
+
+	/* when set, a lost link is retried after a jittered, exponentially
+	 * growing delay between reconnect_{min,max} (0 for the IRC_RECONNECT_*
+	 * defaults) instead of calling on_close */
+	bool reconnect;
+	double reconnect_min;
+	double reconnect_max;
+	unsigned reconnect_attempts;
+	ev_timer reconnect_timer;
+
+	/* when set, once registered we PING the server every ping_interval
+	 * seconds with a cookie, and close the link as dead (see on_close &
+	 * reconnect) if the matching PONG takes longer than ping_timeout. 0
+	 * for the IRC_PING_* defaults. The PINGs skip the send pacing, so it
+	 * doesn't show up as lag. */
+	bool lag_check;
+	double ping_interval;
+	double ping_timeout;
+	ev_timer ping_timer;
+	unsigned ping_seq;
+	bool ping_waiting;
+	ev_tstamp ping_sent;
+	/* round trip of the last PING in seconds, < 0 until one is answered on
+	 * this link. The histogram covers every link. It is NULL until the
+	 * first answer, then malloc()ed and the caller's to free() with @c. */
+	double lag;
+	struct irc_lag_hist *lag_hist;
 
 	/* buffers */
-	size_t in_pos;
-	char in_buf[1024];
+	/* the input buffer grows up to this, 0 means IRC_IN_BUF_MAX */
+	size_t in_max;
+	struct irc_inbuf in;
+	struct irc_outq out;
+
+	/* send pacing, read by irc_init(). Lines per second and how many may
+	 * go out at once, 0 for the IRC_SEND_* defaults. A negative send_rate
+	 * disables pacing. */
+	double send_rate;
+	double send_burst;
+	/* lines wait here, by class, until they may be sent. Its counters are
+	 * the queue depth & wait time statistics. */
+	struct irc_sched sched;
+	ev_timer send_timer;
+
+	/* channel mode changes, packed and sent before the loop next blocks */
+	struct irc_modeq modeq;
+	ev_prepare mode_prepare;
 };
 
-/* for use in callbacks */
+/*
+ * for use in callbacks.
+ *
+ * Commands are queued, paced by the send scheduler with PONG & registration
+ * ahead of channel control ahead of messages, and written out together once
+ * the event loop comes around. They return success without anything having
+ * been sent yet.
+ */
 int irc_cmd(struct irc_connection *c,
 		char const *msg, size_t msg_len);
+/* as irc_cmd(), but with an explicit class instead of one from the verb */
+int irc_cmd_prio(struct irc_connection *c, enum irc_prio prio,
+		char const *msg, size_t msg_len);
+enum irc_prio irc_cmd_prio_of(char const *msg, size_t msg_len);
+/*
+ * Send the concatenation of @parts, with the "\r\n" added. It is copied
+ * straight into the send queue, and dropped (returning -1) if it would be
+ * longer than IRC_MAX_LINE_LENGTH. Prefer this to irc_cmd_fmt() when every
+ * piece is already a (pointer, length) span.
+ */
+int irc_cmd_spans(struct irc_connection *c,
+		const struct arg *parts, size_t part_ct);
+/*
+ * @msg may be any length, and may contain newlines. It is sent as one PRIVMSG
+ * per line, each split at spaces (or failing that, between UTF-8 characters)
+ * into pieces that fit once the server adds our prefix. Every piece is
+ * queued before any is sent.
+ */
 int irc_cmd_privmsg(struct irc_connection *c,
 		char const *dest, size_t dest_len,
 		char const *msg,  size_t msg_len);
+/*
+ * Send @msg to every one of @dests, packing as many comma separated targets
+ * into each PRIVMSG as the server's TARGMAX/MAXTARGETS allows (1 if it never
+ * said) while the message still fits on the line.
+ */
+int irc_cmd_privmsg_multi(struct irc_connection *c,
+		const struct arg *dests, size_t dest_ct,
+		char const *msg, size_t msg_len);
+/* how many bytes of message fit in one PRIVMSG to a @dest_len target */
+size_t irc_privmsg_room(struct irc_connection *c, size_t dest_len);
 
 int PRINTF_FMT(2,3) irc_cmd_fmt(struct irc_connection *c,
 		char const *str, ...);
@@ -132,6 +365,16 @@ int irc_cmd_invite(struct irc_connection *c,
 
 bool irc_user_is_me(struct irc_connection *c, const char *start, size_t len);
 
+/*
+ * Queue a change of channel mode @mode (with @sign '+' or '-', and an
+ * argument if @arg_len != 0). Everything queued during a loop iteration is
+ * sent together, packed into as few MODE lines as the server's MODES= allows.
+ * The channel user mode functions below go through this.
+ */
+int irc_cmd_mode_queue(struct irc_connection *c,
+		const char *channel, size_t channel_len,
+		char sign, char mode,
+		const char *arg, size_t arg_len);
 int irc_clear_channel_user_mode(struct irc_connection *c,
 		const char *channel, size_t channel_len,
 		const char *name, size_t name_len,
@@ -157,8 +400,13 @@ static inline int irc_create_operation_str(struct irc_connection *c,
 	return irc_create_operation_str_(c, str, strlen(str), cb);
 }
 
-/* op is assumed to continue to exist until the op is removed */
+/*
+ * op is assumed to continue to exist until the op is removed.
+ * Does not allocate, so ops in static or embedded storage (IRC_OP_STR_INIT,
+ * DEFINE_IRC_OP_*) are registered for free.
+ */
 void irc_add_operation(struct irc_connection *c, struct irc_operation *op);
+void irc_remove_operation(struct irc_connection *c, struct irc_operation *op);
 
 #define IRC_OP_STR_INIT(cb_, str_) {	\
 	.type = IRC_OP_STR,		\
@@ -181,12 +429,67 @@ void irc_add_operation(struct irc_connection *c, struct irc_operation *op);
 void irc_init(struct irc_connection *c);
 
 /* state managment */
+/*
+ * Encode what another process needs to carry on with the link on the same fd,
+ * as a C initializer list: the fd, server, nick, our channels & user modes,
+ * the input read but not yet handled and the output not yet sent. The fd must
+ * survive the exec (see FD_CLOEXEC). Pass it in a file (a memfd, say) rather
+ * than as an argument: queued lines may hold passwords, and it can outgrow
+ * the limit on an argument's length.
+ *
+ * Only plain irc_io_ev connections can be handed over, TLS state can't.
+ * Not from a handler: the line being handled is still in the input buffer,
+ * and would be handled again.
+ *
+ * return: the length of the state, which like snprintf() may be more than
+ *         @len with the result truncated (@buf may be NULL if @len is 0),
+ *         or 0 if @c can't be handed over.
+ */
 size_t irc_dump_state(struct irc_connection *c, char *buf, size_t len);
+/*
+ * Carry on from irc_dump_state() in place of irc_connect(), after irc_init()
+ * and adding handlers: without registering or rejoining, as the server sees
+ * the same link. Lines that were left buffered are handled before returning.
+ *
+ * The strings loaded into @c (server, nick, ...) are allocated and never
+ * freed.
+ *
+ * return: 0, or -1 if @buf could not be parsed or the fd it names couldn't
+ *         be attached, in which case @c may have been partly filled in and
+ *         should be irc_disconnect()ed.
+ */
 int irc_load_state(struct irc_connection *c, const char *buf, size_t len);
 
 /*
  * utility
  */
+/*
+ * Split up a single line (without its "\r\n"). On success @m refers into
+ * @start.
+ * return: 0 on success, negative errno if the line is malformed.
+ */
+int irc_parse_message(struct irc_message *m, const char *start, size_t len);
+
+/*
+ * Look for the IRCv3 tag @key (such as "time", "msgid", "account", "batch"
+ * or "label") in @m. If found, and @value is not NULL, @value is set to the
+ * still escaped value, empty when the tag has none.
+ */
+bool irc_message_tag(const struct irc_message *m,
+		const char *key, size_t key_len, struct arg *value);
+#define irc_message_tag_(m, key, value) \
+	irc_message_tag(m, key, strlen(key), value)
+
+/*
+ * Undo the escaping of a tag value, writing at most @buf_len bytes to @buf.
+ * return: the length of the unescaped value, if larger than @buf_len the
+ *         output was truncated.
+ */
+size_t irc_tag_unescape(struct arg value, char *buf, size_t buf_len);
+
+enum irc_cmd irc_cmd_lookup(const char *str, size_t str_len);
+enum irc_cmd irc_cmd_from_num(unsigned num);
+
 int irc_parse_args(char const *start, size_t len, struct arg *args,
 		size_t max_args);
 
@@ -196,10 +499,57 @@ int irc_parse_last_args(char const *start, size_t len, struct arg *args,
 /*
  * connection managment
  */
+
+/*
+ * Process @data as if it had been read from the server: it is buffered and
+ * every complete line is dispatched.
+ * return: 0, or -1 if the input buffer could not be allocated.
+ */
+int irc_feed(struct irc_connection *c, const char *data, size_t len);
+
+/*
+ * Resolve server:port and connect to it (trying IPv4 & IPv6 addresses in
+ * parallel, see irc_connector) without blocking the loop.
+ * return: 0 if resolution started, -1 if it couldn't be.
+ */
 int irc_connect(struct irc_connection *c);
+/*
+ * Use the already connected @fd. If the I/O backend can't take it, it is
+ * handled as the server closing the link: closed, then reconnected or
+ * on_close() called, before this returns.
+ */
 void irc_connect_fd(struct irc_connection *c, int fd);
+/*
+ * Close the link right away (anything still queued is dropped), stop
+ * reconnecting, and forget the channels & modes a reconnect would restore.
+ * The connection may be connected again later.
+ */
 void irc_disconnect(struct irc_connection *c);
 bool irc_is_connected(struct irc_connection *c);
+/* if we are in @name, and so will rejoin it after a reconnect */
+bool irc_in_channel(struct irc_connection *c, const char *name,
+		size_t name_len);
+
+/*
+ * A set of connections, typically sharing a loop. Connections are only
+ * added & removed explicitly, closing one doesn't remove it.
+ */
+struct irc_registry {
+	/* struct irc_connection, by reg_node */
+	struct list_head conns;
+	size_t ct;
+};
+
+void irc_registry_init(struct irc_registry *r);
+void irc_registry_add(struct irc_registry *r, struct irc_connection *c);
+void irc_registry_remove(struct irc_connection *c);
+struct irc_connection *irc_registry_find(struct irc_registry *r,
+		const char *nick, size_t nick_len);
+/* how many are currently connected */
+size_t irc_registry_connected(struct irc_registry *r);
+void irc_registry_disconnect_all(struct irc_registry *r);
+
+#define irc_registry_for_each(r, c) list_for_each(&(r)->conns, c, reg_node)
 
 
 #endif
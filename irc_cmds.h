@@ -0,0 +1,28 @@
+
+/* commands with a slot in the static dispatch table (see enum irc_cmd).
+ * New ones also need a case in irc_cmd_lookup(). */
+
+CMD(PRIVMSG)
+CMD(NOTICE)
+CMD(JOIN)
+CMD(PART)
+CMD(QUIT)
+CMD(NICK)
+CMD(MODE)
+CMD(KICK)
+CMD(TOPIC)
+CMD(INVITE)
+
+CMD(PING)
+CMD(PONG)
+CMD(ERROR)
+CMD(KILL)
+CMD(WALLOPS)
+
+/* IRCv3 */
+CMD(CAP)
+CMD(AUTHENTICATE)
+CMD(ACCOUNT)
+CMD(AWAY)
+CMD(CHGHOST)
+CMD(BATCH)
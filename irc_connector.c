@@ -0,0 +1,223 @@
+#include "irc_connector.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ccan/array_size/array_size.h>
+#include <ccan/container_of/container_of.h>
+#include <ccan/pr_debug/pr_debug.h>
+
+static void attempt_report(struct irc_connector *k,
+		struct irc_connect_attempt *a)
+{
+	pr_debug(1, "connect to %s: %s after %.3fs (started at +%.3fs)",
+			a->name, a->err ? strerror(a->err) : "connected",
+			a->finished - a->started, a->started);
+}
+
+static void attempt_close(struct irc_connector *k,
+		struct irc_connect_attempt *a)
+{
+	if (a->w.fd < 0)
+		return;
+	ev_io_stop(k->loop, &a->w);
+	close(a->w.fd);
+	ev_io_set(&a->w, -1, EV_WRITE);
+}
+
+static void connector_stop(struct irc_connector *k)
+{
+	size_t i;
+	ev_timer_stop(k->loop, &k->stagger_timer);
+	ev_timer_stop(k->loop, &k->timeout_timer);
+	for (i = 0; i < k->ct; i++)
+		if (i != k->winner)
+			attempt_close(k, &k->at[i]);
+	k->running = 0;
+	k->next = k->ct;
+}
+
+static void connector_done(struct irc_connector *k, int fd)
+{
+	connector_stop(k);
+	k->cb(k, fd);
+}
+
+static void attempt_failed(struct irc_connector *k,
+		struct irc_connect_attempt *a, int err);
+
+static void connector_next(struct irc_connector *k)
+{
+	while (k->next < k->ct) {
+		struct irc_connect_attempt *a = &k->at[k->next++];
+		a->started = ev_now(k->loop) - k->started;
+
+		int fd = socket(a->addr.ss_family,
+				SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			a->finished = a->started;
+			a->err = errno;
+			attempt_report(k, a);
+			continue;
+		}
+
+		ev_io_set(&a->w, fd, EV_WRITE);
+		k->running++;
+		if (connect(fd, (struct sockaddr *)&a->addr, a->addr_len)
+				&& errno != EINPROGRESS) {
+			attempt_failed(k, a, errno);
+			return;
+		}
+
+		/* success or not, writability says when it's decided */
+		ev_io_start(k->loop, &a->w);
+		ev_timer_set(&k->stagger_timer, k->stagger, 0);
+		ev_timer_start(k->loop, &k->stagger_timer);
+		return;
+	}
+
+	if (!k->running)
+		connector_done(k, -1);
+}
+
+static void attempt_failed(struct irc_connector *k,
+		struct irc_connect_attempt *a, int err)
+{
+	a->finished = ev_now(k->loop) - k->started;
+	a->err = err;
+	attempt_report(k, a);
+	attempt_close(k, a);
+	k->running--;
+
+	/* don't wait out the stagger once something has failed */
+	ev_timer_stop(k->loop, &k->stagger_timer);
+	connector_next(k);
+}
+
+static void attempt_cb(EV_P_ ev_io *w, int revents)
+{
+	struct irc_connect_attempt *a = container_of(w, typeof(*a), w);
+	struct irc_connector *k = w->data;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+		err = errno;
+	if (err) {
+		attempt_failed(k, a, err);
+		return;
+	}
+
+	a->finished = ev_now(EV_A) - k->started;
+	attempt_report(k, a);
+
+	int fd = w->fd;
+	ev_io_stop(EV_A_ w);
+	ev_io_set(w, -1, EV_WRITE);
+	k->winner = a - k->at;
+	connector_done(k, fd);
+}
+
+static void stagger_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct irc_connector *k = container_of(w, typeof(*k), stagger_timer);
+	connector_next(k);
+}
+
+static void timeout_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct irc_connector *k = container_of(w, typeof(*k), timeout_timer);
+	size_t i;
+	for (i = 0; i < k->next; i++) {
+		struct irc_connect_attempt *a = &k->at[i];
+		if (a->w.fd >= 0) {
+			a->finished = ev_now(EV_A) - k->started;
+			a->err = ETIMEDOUT;
+			attempt_report(k, a);
+		}
+	}
+	connector_done(k, -1);
+}
+
+static void connector_add(struct irc_connector *k, const struct addrinfo *ai)
+{
+	if (k->ct >= ARRAY_SIZE(k->at) || ai->ai_addrlen > sizeof(k->at[0].addr))
+		return;
+
+	struct irc_connect_attempt *a = &k->at[k->ct++];
+	memcpy(&a->addr, ai->ai_addr, ai->ai_addrlen);
+	a->addr_len = ai->ai_addrlen;
+	a->started = a->finished = -1;
+	a->err = 0;
+	if (getnameinfo(ai->ai_addr, ai->ai_addrlen, a->name, sizeof(a->name),
+				NULL, 0, NI_NUMERICHOST))
+		strcpy(a->name, "?");
+	ev_io_init(&a->w, attempt_cb, -1, EV_WRITE);
+	a->w.data = k;
+}
+
+int irc_connector_start(EV_P_ struct irc_connector *k,
+		const struct addrinfo *res, irc_connector_cb cb)
+{
+	const struct addrinfo *by_family[2] = {}, *ai;
+
+	k->loop = EV_A;
+	k->cb = cb;
+	k->ct = k->next = k->running = 0;
+	if (!k->stagger)
+		k->stagger = IRC_CONNECT_STAGGER;
+	if (!k->timeout)
+		k->timeout = IRC_CONNECT_TIMEOUT;
+
+	/* interleave families, starting with whichever the resolver put first */
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (ai->ai_socktype && ai->ai_socktype != SOCK_STREAM)
+			continue;
+		if (!by_family[0] || by_family[0]->ai_family == ai->ai_family) {
+			if (!by_family[0])
+				by_family[0] = ai;
+		} else if (!by_family[1]) {
+			by_family[1] = ai;
+		}
+	}
+
+	const struct addrinfo *cur[2] = { by_family[0], by_family[1] };
+	size_t turn = 0;
+	while (cur[0] || cur[1]) {
+		const struct addrinfo **p = &cur[turn];
+		if (*p) {
+			connector_add(k, *p);
+			int fam = (*p)->ai_family;
+			do
+				*p = (*p)->ai_next;
+			while (*p && ((*p)->ai_family != fam
+					|| ((*p)->ai_socktype
+						&& (*p)->ai_socktype != SOCK_STREAM)));
+		}
+		turn = !turn;
+	}
+
+	if (!k->ct)
+		return -1;
+
+	k->winner = k->ct;
+	k->started = ev_now(EV_A);
+	ev_timer_init(&k->stagger_timer, stagger_cb, k->stagger, 0);
+	ev_timer_init(&k->timeout_timer, timeout_cb, k->timeout, 0);
+	ev_timer_start(EV_A_ &k->timeout_timer);
+	connector_next(k);
+	return 0;
+}
+
+void irc_connector_cancel(struct irc_connector *k)
+{
+	if (!k->loop)
+		return;
+	connector_stop(k);
+}
+
+bool irc_connector_active(struct irc_connector *k)
+{
+	return k->loop && ev_is_active(&k->timeout_timer);
+}
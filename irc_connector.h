@@ -0,0 +1,78 @@
+#ifndef IRC_CONNECTOR_H_
+#define IRC_CONNECTOR_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <ev.h>
+
+/*
+ * Non-blocking connect to the first reachable address of a lookup, in the
+ * style of "happy eyeballs" (RFC 8305): addresses are tried alternating
+ * between families, a new attempt starts every IRC_CONNECT_STAGGER seconds
+ * (or as soon as one fails) while earlier ones keep going, and the first
+ * socket to connect wins.
+ */
+
+#define IRC_CONNECT_STAGGER   0.25
+#define IRC_CONNECT_TIMEOUT   30.
+/* addresses past this are ignored */
+#define IRC_CONNECT_ATTEMPTS  8
+
+struct irc_connector;
+
+/* @fd is a connected, non-blocking socket, or -1 if every attempt failed */
+typedef void (*irc_connector_cb)(struct irc_connector *k, int fd);
+
+struct irc_connect_attempt {
+	ev_io w;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	/* numeric address, for reports */
+	char name[64];
+
+	/* relative to irc_connector.started, finished < 0 while in progress */
+	ev_tstamp started;
+	ev_tstamp finished;
+	/* errno the attempt failed with, 0 if it connected (or isn't done) */
+	int err;
+};
+
+struct irc_connector {
+	struct ev_loop *loop;
+	irc_connector_cb cb;
+	/* for @cb, untouched */
+	void *data;
+
+	/* read by irc_connector_start(), 0 for the IRC_CONNECT_* defaults */
+	double stagger;
+	double timeout;
+
+	ev_tstamp started;
+	ev_timer stagger_timer;
+	ev_timer timeout_timer;
+
+	/* in the order they are tried */
+	struct irc_connect_attempt at[IRC_CONNECT_ATTEMPTS];
+	size_t ct;
+	/* next to start */
+	size_t next;
+	/* started and not finished */
+	size_t running;
+	/* the one that connected, or ct */
+	size_t winner;
+};
+
+/*
+ * Begin connecting to the addresses in @res, which are copied. @cb is called
+ * from @loop with the outcome.
+ * return: 0, or -1 if @res holds no usable address.
+ */
+int irc_connector_start(EV_P_ struct irc_connector *k,
+		const struct addrinfo *res, irc_connector_cb cb);
+/* give up, closing every socket in progress. @cb is not called. */
+void irc_connector_cancel(struct irc_connector *k);
+bool irc_connector_active(struct irc_connector *k);
+
+#endif
@@ -0,0 +1,324 @@
+#include "irc_dns.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tommyds/tommyhashlin.h>
+
+#include <ccan/container_of/container_of.h>
+#include <ccan/list/list.h>
+#include <ccan/net/net.h>
+#include <ccan/err/err.h>
+#include <ccan/pr_debug/pr_debug.h>
+
+struct irc_dns_entry {
+	tommy_node node;
+	/* dns_entries, for sweeping */
+	struct list_node entry_node;
+	/* dns_queue, until a thread picks the lookup up */
+	struct list_node queue_node;
+	/* one for being in the cache, one for a running lookup, one for
+	 * every query it has been handed to */
+	unsigned refs;
+
+	/* everything below is fixed once done is set */
+	bool done;
+	struct addrinfo *res;
+	ev_tstamp expires;
+	struct irc_dns_query *waiting;
+
+	int family;
+	size_t host_len;
+	/* "host\0port\0" */
+	size_t key_len;
+	char key[];
+};
+
+struct dns_key {
+	const char *host, *port;
+	size_t host_len, port_len;
+	int family;
+};
+
+/* guards everything here, entries included */
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static tommy_hashlin dns_cache;
+static bool dns_cache_ready;
+static LIST_HEAD(dns_entries);
+static ev_tstamp dns_swept;
+static double dns_ttl = IRC_DNS_TTL;
+static double dns_neg_ttl = IRC_DNS_NEG_TTL;
+
+/* lookups waiting for one of the dns_threads */
+static LIST_HEAD(dns_queue);
+static size_t dns_queued;
+static pthread_cond_t dns_cond = PTHREAD_COND_INITIALIZER;
+static size_t dns_threads;
+/* waiting on dns_cond */
+static size_t dns_idle;
+
+static uint32_t dns_hash(const struct dns_key *k)
+{
+	uint32_t h = tommy_hash_u32(k->family, k->host, k->host_len);
+	return tommy_hash_u32(h, k->port, k->port_len);
+}
+
+static int compare_key_to_entry(const void *k_, const void *e_)
+{
+	const struct dns_key *k = k_;
+	const struct irc_dns_entry *e = e_;
+	return !(e->family == k->family
+		&& e->host_len == k->host_len
+		&& e->key_len == k->host_len + k->port_len + 2
+		&& !memcmp(e->key, k->host, k->host_len)
+		&& !memcmp(e->key + k->host_len + 1, k->port, k->port_len));
+}
+
+/* with dns_lock held */
+static void dns_put(struct irc_dns_entry *e)
+{
+	if (--e->refs)
+		return;
+	if (e->res)
+		freeaddrinfo(e->res);
+	free(e);
+}
+
+/*
+ * With dns_lock held, drops the cache's ref. Queries that were handed the
+ * entry keep their own.
+ */
+static void dns_evict(struct irc_dns_entry *e)
+{
+	tommy_hashlin_remove_existing(&dns_cache, &e->node);
+	list_del(&e->entry_node);
+	dns_put(e);
+}
+
+/* with dns_lock held: evict finished entries that expire before @before */
+static void dns_sweep(ev_tstamp before)
+{
+	struct irc_dns_entry *e, *next;
+	list_for_each_safe(&dns_entries, e, next, entry_node)
+		if (e->done && e->expires <= before)
+			dns_evict(e);
+}
+
+/* with dns_lock held */
+static void dns_finish(struct irc_dns_entry *e, struct addrinfo *res)
+{
+	e->res = res;
+	e->expires = ev_time() + (res ? dns_ttl : dns_neg_ttl);
+	e->done = true;
+
+	struct irc_dns_query *q = e->waiting;
+	e->waiting = NULL;
+	while (q) {
+		struct irc_dns_query *next = q->next;
+		q->next = NULL;
+		ev_async_send(q->loop, &q->done);
+		q = next;
+	}
+
+	dns_put(e);
+}
+
+/* runs lookups from dns_queue, for as long as the process does */
+static void *dns_thread(void *unused)
+{
+	pthread_mutex_lock(&dns_lock);
+	for (;;) {
+		struct irc_dns_entry *e;
+		while (!(e = list_pop(&dns_queue, struct irc_dns_entry,
+						queue_node))) {
+			dns_idle++;
+			pthread_cond_wait(&dns_cond, &dns_lock);
+			dns_idle--;
+		}
+		dns_queued--;
+		pthread_mutex_unlock(&dns_lock);
+
+		struct addrinfo *res = net_client_lookup(e->key,
+				e->key + e->host_len + 1, e->family, SOCK_STREAM);
+
+		pthread_mutex_lock(&dns_lock);
+		dns_finish(e, res);
+	}
+	return NULL;
+}
+
+/* with dns_lock held: queue @e's lookup, starting a thread if none is free */
+static int dns_queue_lookup(struct irc_dns_entry *e)
+{
+	if (dns_queued >= dns_idle && dns_threads < IRC_DNS_THREADS) {
+		pthread_t t;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		int r = pthread_create(&t, &attr, dns_thread, NULL);
+		pthread_attr_destroy(&attr);
+		if (!r) {
+			dns_threads++;
+		} else if (!dns_threads) {
+			errno = r;
+			return -1;
+		}
+		/* otherwise one of the running threads gets to it */
+	}
+
+	list_add_tail(&dns_queue, &e->queue_node);
+	dns_queued++;
+	pthread_cond_signal(&dns_cond);
+	return 0;
+}
+
+/* with dns_lock held */
+static struct irc_dns_entry *dns_start(const struct dns_key *k, uint32_t hash)
+{
+	size_t key_len = k->host_len + k->port_len + 2;
+	struct irc_dns_entry *e = malloc(sizeof(*e) + key_len);
+	if (!e)
+		return NULL;
+
+	*e = (struct irc_dns_entry) {
+		.refs = 2,
+		.family = k->family,
+		.host_len = k->host_len,
+		.key_len = key_len,
+	};
+	memcpy(e->key, k->host, k->host_len + 1);
+	memcpy(e->key + k->host_len + 1, k->port, k->port_len + 1);
+
+	if (dns_queue_lookup(e)) {
+		warn("could not start a lookup of %s", k->host);
+		free(e);
+		return NULL;
+	}
+
+	/* names that are no longer looked up don't stay around forever, but
+	 * walking the whole cache on every insert would be too much */
+	ev_tstamp now = ev_time();
+	if (now - dns_swept >= dns_neg_ttl) {
+		dns_sweep(now);
+		dns_swept = now;
+	}
+
+	tommy_hashlin_insert(&dns_cache, &e->node, e, hash);
+	list_add_tail(&dns_entries, &e->entry_node);
+	return e;
+}
+
+static void dns_done_cb(EV_P_ ev_async *w, int revents)
+{
+	struct irc_dns_query *q = container_of(w, typeof(*q), done);
+	struct irc_dns_entry *e = q->e;
+
+	ev_async_stop(EV_A_ w);
+
+	/* res doesn't change once the entry is done, and our ref keeps it */
+	q->e = NULL;
+	q->cb(q, e->res);
+
+	pthread_mutex_lock(&dns_lock);
+	dns_put(e);
+	pthread_mutex_unlock(&dns_lock);
+}
+
+int irc_dns_resolve(EV_P_ struct irc_dns_query *q,
+		const char *host, const char *port, int family, irc_dns_cb cb)
+{
+	struct dns_key k = {
+		.host = host,
+		.port = port,
+		.host_len = strlen(host),
+		.port_len = strlen(port),
+		.family = family,
+	};
+	uint32_t hash = dns_hash(&k);
+
+	pthread_mutex_lock(&dns_lock);
+	if (!dns_cache_ready) {
+		tommy_hashlin_init(&dns_cache);
+		dns_cache_ready = true;
+	}
+
+	struct irc_dns_entry *e = tommy_hashlin_search(&dns_cache,
+			compare_key_to_entry, &k, hash);
+	if (e && e->done && e->expires <= ev_time()) {
+		dns_evict(e);
+		e = NULL;
+	}
+
+	if (e) {
+		pr_debug(2, "dns: %s %s", host, e->done ? "cached" : "in progress");
+	} else {
+		e = dns_start(&k, hash);
+		if (!e) {
+			pthread_mutex_unlock(&dns_lock);
+			return -1;
+		}
+	}
+
+	e->refs++;
+	q->e = e;
+	q->cb = cb;
+	q->loop = EV_A;
+	q->next = NULL;
+	ev_async_init(&q->done, dns_done_cb);
+	ev_async_start(EV_A_ &q->done);
+
+	if (e->done) {
+		ev_async_send(EV_A_ &q->done);
+	} else {
+		q->next = e->waiting;
+		e->waiting = q;
+	}
+	pthread_mutex_unlock(&dns_lock);
+	return 0;
+}
+
+bool irc_dns_pending(struct irc_dns_query *q)
+{
+	return q->e;
+}
+
+void irc_dns_cancel(struct irc_dns_query *q)
+{
+	struct irc_dns_entry *e = q->e;
+	if (!e)
+		return;
+
+	ev_async_stop(q->loop, &q->done);
+
+	pthread_mutex_lock(&dns_lock);
+	struct irc_dns_query **p;
+	for (p = &e->waiting; *p; p = &(*p)->next) {
+		if (*p == q) {
+			*p = q->next;
+			break;
+		}
+	}
+	dns_put(e);
+	pthread_mutex_unlock(&dns_lock);
+
+	q->e = NULL;
+}
+
+void irc_dns_set_ttl(double ttl, double neg_ttl)
+{
+	pthread_mutex_lock(&dns_lock);
+	dns_ttl = ttl;
+	dns_neg_ttl = neg_ttl;
+	pthread_mutex_unlock(&dns_lock);
+}
+
+void irc_dns_flush(void)
+{
+	pthread_mutex_lock(&dns_lock);
+	if (dns_cache_ready)
+		dns_sweep(INFINITY);
+	pthread_mutex_unlock(&dns_lock);
+}
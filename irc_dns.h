@@ -0,0 +1,61 @@
+#ifndef IRC_DNS_H_
+#define IRC_DNS_H_
+
+#include <stdbool.h>
+#include <netdb.h>
+#include <ev.h>
+
+/*
+ * Name resolution off the event loop.
+ *
+ * Lookups are queued for a few helper threads and their results are posted
+ * back to the requesting loop with an ev_async. Results are kept in a cache
+ * shared by every connection (and every loop), and concurrent lookups of the
+ * same name share a single getaddrinfo(). Expired results are swept out as
+ * new names are added.
+ */
+
+/* how long results are kept, in seconds, unless irc_dns_set_ttl() says */
+#define IRC_DNS_TTL     300.
+#define IRC_DNS_NEG_TTL 30.
+/* started as lookups queue up, and kept */
+#define IRC_DNS_THREADS 4
+
+struct irc_dns_entry;
+struct irc_dns_query;
+
+/* @res is NULL if resolution failed, and is only valid during the call */
+typedef void (*irc_dns_cb)(struct irc_dns_query *q, const struct addrinfo *res);
+
+struct irc_dns_query {
+	ev_async done;
+	struct ev_loop *loop;
+	irc_dns_cb cb;
+
+	/* private */
+	struct irc_dns_entry *e;
+	/* others waiting on the same lookup */
+	struct irc_dns_query *next;
+};
+
+/*
+ * Look up @host/@port, calling @cb from @loop once it is known. @cb is called
+ * from the loop even for cached results, never from within this call.
+ * return: 0, or -1 if the lookup could not be started.
+ */
+int irc_dns_resolve(EV_P_ struct irc_dns_query *q,
+		const char *host, const char *port, int family, irc_dns_cb cb);
+
+/* stop waiting for a lookup, @cb won't be called */
+void irc_dns_cancel(struct irc_dns_query *q);
+bool irc_dns_pending(struct irc_dns_query *q);
+
+/*
+ * getaddrinfo() doesn't report record TTLs, so successful results are kept
+ * for @ttl seconds and failures for @neg_ttl.
+ */
+void irc_dns_set_ttl(double ttl, double neg_ttl);
+/* forget everything cached (lookups in progress are unaffected) */
+void irc_dns_flush(void);
+
+#endif
@@ -8,11 +8,14 @@
  * PING
  */
 static int irc_helper_ping(struct irc_connection *c, struct irc_operation *op,
-		const char *prefix, size_t prefix_len,
-		const char *remain, size_t remain_len)
+		const struct irc_message *m)
 {
 	/* XXX: ensure @p has a server spec. */
-	irc_cmd_fmt(c, "PONG %.*s", (int)remain_len, remain);
+	struct arg parts[] = {
+		IRC_ARG_LIT("PONG "),
+		m->remain,
+	};
+	irc_cmd_spans(c, parts, ARRAY_SIZE(parts));
 	return 0;
 }
 
@@ -47,15 +50,13 @@ static struct arg next_comma_arg(struct arg a, const char *end)
 	     arg = next_comma_arg(arg, base_arg.data + base_arg.len))
 
 int privmsg_helper(struct irc_connection *c, struct irc_operation *op,
-		const char *prefix, size_t prefix_len,
-		const char *start, size_t len,
+		const struct irc_message *m,
 		privmsg_cb cb)
 {
-	struct arg args[2];
-	int r = irc_parse_args(start, len, args, ARRAY_SIZE(args));
-	if (r != ARRAY_SIZE(args)) {
-		pr_debug(0, "PRIVMSG requires exactly %zu arguments, got %d",
-				ARRAY_SIZE(args), r);
+	const struct arg *args = m->params;
+	if (m->param_ct != 2) {
+		pr_debug(0, "PRIVMSG requires exactly 2 arguments, got %zu",
+				m->param_ct);
 		return -1;
 	}
 
@@ -81,7 +82,7 @@ int privmsg_helper(struct irc_connection *c, struct irc_operation *op,
 
 	pr_debug(2, "message contents: %.*s\n", (int)args[1].len, args[1].data);
 
-	return cb(c, op, prefix, prefix_len, dests, dest_ct,
+	return cb(c, op, m, dests, dest_ct,
 			args[1].data, args[1].len);
 }
 
@@ -6,16 +6,17 @@
 struct irc_connection;
 struct irc_operation;
 struct arg;
+struct irc_message;
 
 int irc_add_ping_handler(struct irc_connection *c);
 
 
+/* the sender is in m->nick, or m->host if m->from_server */
 typedef int (*privmsg_cb)(struct irc_connection *c, struct irc_operation *op,
-			char const *source, size_t source_len,
+			const struct irc_message *m,
 			struct arg *dests, size_t dest_ct,
 			char const *msg, size_t msg_len);
 int privmsg_helper(struct irc_connection *c, struct irc_operation *op,
-		const char *prefix, size_t prefix_len,
-		const char *start, size_t len,
+		const struct irc_message *m,
 		privmsg_cb cb);
 #endif
@@ -0,0 +1,319 @@
+#include "irc_inbuf.h"
+#include "irc_scan.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ccan/array_size/array_size.h>
+#include <ccan/err/err.h>
+
+/* size of the first allocation, doubled each time the ring fills up */
+#define IRC_INBUF_MIN 1024
+/* first allocations come from a pool shared by every ring, carved out of
+ * slabs of this many */
+#define IRC_INBUF_SLAB 64
+/* each thread keeps up to this many of them, and only goes to the shared
+ * pool (half of this at a time) when it has none or too many */
+#define IRC_INBUF_LOCAL 16
+
+struct pool_buf {
+	struct pool_buf *next;
+};
+
+/* rings may live on several threads (see irc_runtime) */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_buf *pool_free;
+
+static __thread struct pool_buf *local_free;
+static __thread size_t local_ct;
+static __thread bool local_keyed;
+/* only to hand a thread's buffers back when it exits */
+static pthread_key_t local_key;
+static bool local_key_ok;
+static pthread_once_t local_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Move up to @ct buffers from @from to @to.
+ * return: how many were moved.
+ */
+static size_t pool_move(struct pool_buf **to, struct pool_buf **from, size_t ct)
+{
+	size_t i;
+	for (i = 0; i < ct && *from; i++) {
+		struct pool_buf *b = *from;
+		*from = b->next;
+		b->next = *to;
+		*to = b;
+	}
+	return i;
+}
+
+static void local_exit(void *unused)
+{
+	pthread_mutex_lock(&pool_lock);
+	pool_move(&pool_free, &local_free, local_ct);
+	pthread_mutex_unlock(&pool_lock);
+	local_ct = 0;
+}
+
+static void local_key_init(void)
+{
+	local_key_ok = !pthread_key_create(&local_key, local_exit);
+	if (!local_key_ok)
+		warnx("inbuf: buffers of exiting threads won't be reused");
+}
+
+static void local_refill(void)
+{
+	size_t i;
+	pthread_mutex_lock(&pool_lock);
+	if (!pool_free) {
+		char *slab = malloc((size_t)IRC_INBUF_SLAB * IRC_INBUF_MIN);
+		for (i = 0; slab && i < IRC_INBUF_SLAB; i++) {
+			struct pool_buf *b = (void *)(slab + i * IRC_INBUF_MIN);
+			b->next = pool_free;
+			pool_free = b;
+		}
+	}
+
+	local_ct += pool_move(&local_free, &pool_free, IRC_INBUF_LOCAL / 2);
+	pthread_mutex_unlock(&pool_lock);
+
+	/* the destructor only runs for a non-NULL value */
+	if (!local_keyed) {
+		pthread_once(&local_once, local_key_init);
+		if (local_key_ok)
+			pthread_setspecific(local_key, &local_free);
+		local_keyed = true;
+	}
+}
+
+static char *pool_get(void)
+{
+	if (!local_free)
+		local_refill();
+
+	struct pool_buf *b = local_free;
+	if (b) {
+		local_free = b->next;
+		local_ct--;
+	}
+	return (char *)b;
+}
+
+/* grown buffers are the malloc()'s, the first size goes back to the pool */
+static void buf_free(char *buf, size_t cap)
+{
+	if (!buf)
+		return;
+	if (cap != IRC_INBUF_MIN) {
+		free(buf);
+		return;
+	}
+
+	struct pool_buf *b = (void *)buf;
+	b->next = local_free;
+	local_free = b;
+	if (++local_ct <= IRC_INBUF_LOCAL)
+		return;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_move(&pool_free, &local_free, IRC_INBUF_LOCAL / 2);
+	pthread_mutex_unlock(&pool_lock);
+	local_ct -= IRC_INBUF_LOCAL / 2;
+}
+
+void irc_inbuf_init(struct irc_inbuf *in)
+{
+	*in = (struct irc_inbuf) {};
+}
+
+void irc_inbuf_free(struct irc_inbuf *in)
+{
+	buf_free(in->buf, in->cap);
+	free(in->line);
+	irc_inbuf_init(in);
+}
+
+void irc_inbuf_release(struct irc_inbuf *in)
+{
+	if (in->len || !in->buf)
+		return;
+
+	bool discard = in->discard;
+	irc_inbuf_free(in);
+	in->discard = discard;
+}
+
+/* move to a buffer of @cap bytes, unwrapping the content */
+static int inbuf_resize(struct irc_inbuf *in, size_t cap)
+{
+	char *buf = malloc(cap);
+	if (!buf)
+		return -1;
+
+	struct iovec iov[2];
+	int i, ct = irc_inbuf_data(in, iov);
+	size_t pos = 0;
+	for (i = 0; i < ct; i++) {
+		memcpy(buf + pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+
+	buf_free(in->buf, in->cap);
+	in->buf = buf;
+	in->cap = cap;
+	in->head = 0;
+	return 0;
+}
+
+int irc_inbuf_prepare(struct irc_inbuf *in, size_t max, struct iovec iov[2])
+{
+	if (max < IRC_INBUF_MIN)
+		max = IRC_INBUF_MIN;
+
+	if (!in->buf) {
+		in->buf = pool_get();
+		if (!in->buf)
+			return -1;
+		in->cap = IRC_INBUF_MIN;
+		in->head = 0;
+	}
+
+	if (in->len == in->cap) {
+		if (in->cap < max) {
+			size_t cap = in->cap * 2;
+			if (cap > max)
+				cap = max;
+			if (inbuf_resize(in, cap))
+				return -1;
+		} else {
+			/* lines are consumed as they arrive, so this is all
+			 * one line */
+			warnx("line longer than %zu bytes, discarding.", in->cap);
+			in->discard = true;
+			in->head = 0;
+			in->len = 0;
+			in->scanned = 0;
+		}
+	}
+
+	size_t tail = (in->head + in->len) % in->cap;
+	if (tail < in->head) {
+		iov[0] = (struct iovec){ in->buf + tail, in->head - tail };
+		return 1;
+	}
+
+	iov[0] = (struct iovec){ in->buf + tail, in->cap - tail };
+	if (!in->head)
+		return 1;
+	iov[1] = (struct iovec){ in->buf, in->head };
+	return 2;
+}
+
+void irc_inbuf_commit(struct irc_inbuf *in, size_t n)
+{
+	in->len += n;
+}
+
+int irc_inbuf_data(const struct irc_inbuf *in, struct iovec iov[2])
+{
+	if (!in->len)
+		return 0;
+
+	if (in->head + in->len <= in->cap) {
+		iov[0] = (struct iovec){ in->buf + in->head, in->len };
+		return 1;
+	}
+
+	size_t first = in->cap - in->head;
+	iov[0] = (struct iovec){ in->buf + in->head, first };
+	iov[1] = (struct iovec){ in->buf, in->len - first };
+	return 2;
+}
+
+/* the first @len bytes of the ring, made contiguous if needed */
+static char *inbuf_linear(struct irc_inbuf *in, size_t len)
+{
+	if (in->head + len <= in->cap)
+		return in->buf + in->head;
+
+	if (in->line_cap < len) {
+		char *line = realloc(in->line, len);
+		if (!line)
+			return NULL;
+		in->line = line;
+		in->line_cap = len;
+	}
+
+	size_t first = in->cap - in->head;
+	memcpy(in->line, in->buf + in->head, first);
+	memcpy(in->line + first, in->buf, len - first);
+	return in->line;
+}
+
+static void inbuf_consume(struct irc_inbuf *in, size_t len)
+{
+	in->len -= len;
+	if (in->len)
+		in->head = (in->head + len) % in->cap;
+	else
+		in->head = 0;
+}
+
+size_t irc_inbuf_lines(struct irc_inbuf *in, size_t max_lines,
+		irc_inbuf_line_cb cb, void *ctx)
+{
+	size_t lines = 0;
+
+	while (lines < max_lines && in->scanned < in->len) {
+		size_t ends[64];
+		size_t pos = (in->head + in->scanned) % in->cap;
+		size_t seg = in->len - in->scanned;
+		if (seg > in->cap - pos)
+			seg = in->cap - pos;
+		size_t want = max_lines - lines;
+		if (want > ARRAY_SIZE(ends))
+			want = ARRAY_SIZE(ends);
+
+		size_t ct = irc_scan_lines(in->buf + pos, seg, ends, want);
+
+		/* offsets are relative to @head at the start of the scan */
+		size_t base = in->scanned;
+		size_t done = 0;
+		size_t i;
+		for (i = 0; i < ct; i++) {
+			size_t len = base + ends[i] - done;
+			char *line = inbuf_linear(in, len);
+
+			if (!line) {
+				warnx("could not allocate a line, discarding.");
+			} else if (in->discard) {
+				in->discard = false;
+			} else {
+				if (len && line[len - 1] == '\r')
+					len--;
+				/* empty messages are silently ignored */
+				if (len) {
+					cb(ctx, line, len);
+					lines++;
+					/* the connection was torn down */
+					if (!in->cap)
+						return lines;
+				}
+			}
+
+			inbuf_consume(in, base + ends[i] - done + 1);
+			done = base + ends[i] + 1;
+		}
+
+		if (ct == want)
+			in->scanned = 0;
+		else
+			in->scanned = base + seg - done;
+	}
+
+	return lines;
+}
@@ -0,0 +1,76 @@
+#ifndef IRC_INBUF_H_
+#define IRC_INBUF_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Input ring. Holds the bytes read from the server that have not been
+ * handed out as lines yet: @len bytes starting at @head, wrapping at @cap.
+ *
+ * Reads go directly into the free space (both pieces of it, via readv()),
+ * and lines are handed out in place. Only a line that wraps around the end
+ * of the ring is copied, into @line.
+ */
+struct irc_inbuf {
+	char *buf;
+	size_t cap;
+	size_t head;
+	size_t len;
+
+	/* bytes after @head known not to contain a line end */
+	size_t scanned;
+
+	/* a line that wraps is made contiguous here */
+	char *line;
+	size_t line_cap;
+
+	/* set while skipping the remains of a line that did not fit */
+	bool discard;
+};
+
+void irc_inbuf_init(struct irc_inbuf *in);
+void irc_inbuf_free(struct irc_inbuf *in);
+/*
+ * Give the storage back if nothing is buffered, so an idle ring holds no
+ * memory. The next irc_inbuf_prepare() takes a buffer from a pool shared by
+ * every ring.
+ */
+void irc_inbuf_release(struct irc_inbuf *in);
+
+/*
+ * Fill @iov with the free space in the ring, allocating or growing it
+ * (up to @max bytes) when it is full.
+ *
+ * When the ring is already @max bytes and full of a single partial line,
+ * that line is dropped (along with whatever of it is still to come).
+ *
+ * return: the number of iovecs filled in (1 or 2), or -1 if memory could
+ *         not be allocated.
+ */
+int irc_inbuf_prepare(struct irc_inbuf *in, size_t max, struct iovec iov[2]);
+
+/* @n bytes were written into the space returned by irc_inbuf_prepare() */
+void irc_inbuf_commit(struct irc_inbuf *in, size_t n);
+
+/*
+ * Fill @iov with the buffered data, in order.
+ * return: the number of iovecs filled in (0, 1, or 2)
+ */
+int irc_inbuf_data(const struct irc_inbuf *in, struct iovec iov[2]);
+
+typedef void (*irc_inbuf_line_cb)(void *ctx, char *line, size_t len);
+
+/*
+ * Hand each complete line (without its "\r\n" or "\n") to @cb, consuming
+ * it, until either no complete lines remain or @max_lines were handed out.
+ * The line is only valid during the call to @cb. Empty lines are skipped.
+ * @cb may irc_inbuf_free() @in, which ends the walk.
+ *
+ * return: the number of lines handed to @cb.
+ */
+size_t irc_inbuf_lines(struct irc_inbuf *in, size_t max_lines,
+		irc_inbuf_line_cb cb, void *ctx);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef IRC_IO_H_
+#define IRC_IO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * How a connected socket gets read & written. Everything else (timers,
+ * resolving, connecting) stays on the connection's ev_loop; a backend only
+ * moves bytes between c->fd and irc_feed() / c->out.
+ */
+
+struct irc_connection;
+
+struct irc_io_ops {
+	const char *name;
+	/* start reading c->fd
+	 * return: 0, or -1 if it can't be used (it is detached & closed) */
+	int (*attach)(struct irc_connection *c);
+	/* stop all I/O on c->fd, which is closed right after */
+	void (*detach)(struct irc_connection *c);
+	/* c->out has something to write */
+	void (*kick)(struct irc_connection *c);
+	/* attached, and the server hasn't closed the link */
+	bool (*active)(struct irc_connection *c);
+};
+
+/* the default: readiness from ev_io, readv()/writev() on it */
+extern const struct irc_io_ops irc_io_ev;
+
+/*
+ * For backends: the server closed the link, or it failed. Incoming data is
+ * handed over with irc_feed(), or read in place with irc_io_prepare() &
+ * irc_io_commit().
+ */
+void irc_io_closed(struct irc_connection *c);
+/*
+ * Space to read into at the end of the input buffer, as for
+ * irc_inbuf_prepare().
+ * return: how many of @iov are filled in, or -1 if it couldn't be allocated.
+ */
+int irc_io_prepare(struct irc_connection *c, struct iovec iov[2]);
+/* @len bytes were read into that space, dispatch any complete lines */
+void irc_io_commit(struct irc_connection *c, size_t len);
+/* nothing more to read for now, lets go of the input buffer if it's empty */
+void irc_io_read_done(struct irc_connection *c);
+
+#endif
@@ -0,0 +1,74 @@
+#include "irc_lag.h"
+
+#include <string.h>
+
+void irc_lag_hist_reset(struct irc_lag_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+/* values below IRC_LAG_SUB get a bucket each, above that a power of 2 is
+ * split into IRC_LAG_SUB buckets by the bits after the leading one */
+static unsigned bucket_of(uint32_t us)
+{
+	if (us < IRC_LAG_SUB)
+		return us;
+	unsigned e = 31 - __builtin_clz(us) - IRC_LAG_SUB_BITS;
+	return e * IRC_LAG_SUB + (us >> e);
+}
+
+/* the largest value recorded in bucket @i */
+static uint32_t bucket_top(unsigned i)
+{
+	if (i < IRC_LAG_SUB)
+		return i;
+	unsigned e = i / IRC_LAG_SUB - 1;
+	uint32_t m = i % IRC_LAG_SUB + IRC_LAG_SUB;
+	return (m << e) + ((1u << e) - 1);
+}
+
+void irc_lag_hist_add(struct irc_lag_hist *h, double secs)
+{
+	if (secs < 0)
+		secs = 0;
+	double us = secs * 1e6;
+	h->ct[bucket_of(us >= UINT32_MAX ? UINT32_MAX : (uint32_t)us)]++;
+
+	if (!h->samples || secs < h->min)
+		h->min = secs;
+	if (secs > h->max)
+		h->max = secs;
+	h->samples++;
+	h->sum += secs;
+}
+
+double irc_lag_hist_quantile(const struct irc_lag_hist *h, double q)
+{
+	if (!h->samples)
+		return 0;
+	/* known exactly */
+	if (q <= 0)
+		return h->min;
+	if (q >= 1)
+		return h->max;
+
+	/* nearest rank: the smallest value covering ceil(q * samples) */
+	double rank = q * h->samples;
+	unsigned long long want = rank, seen = 0;
+	if (want < rank || !want)
+		want++;
+
+	unsigned i;
+	for (i = 0; i < IRC_LAG_BUCKETS; i++) {
+		seen += h->ct[i];
+		if (seen >= want)
+			break;
+	}
+
+	double v = bucket_top(i < IRC_LAG_BUCKETS ? i : IRC_LAG_BUCKETS - 1) / 1e6;
+	if (v > h->max)
+		v = h->max;
+	if (v < h->min)
+		v = h->min;
+	return v;
+}
@@ -0,0 +1,40 @@
+#ifndef IRC_LAG_H_
+#define IRC_LAG_H_
+
+#include <stdint.h>
+
+/* how often to PING the server, and how long it has to answer */
+#define IRC_PING_INTERVAL 30.
+#define IRC_PING_TIMEOUT  60.
+
+/*
+ * Round trip time histogram, log-linear in the style of HdrHistogram: each
+ * power of 2 microseconds is split into 2^IRC_LAG_SUB_BITS equal buckets, so
+ * any value is recorded to within 1/2^IRC_LAG_SUB_BITS of itself, from 1us up
+ * to over an hour, in a fixed ~1KiB.
+ */
+#define IRC_LAG_SUB_BITS 3
+#define IRC_LAG_SUB      (1u << IRC_LAG_SUB_BITS)
+/* values are clamped to 2^32 - 1 microseconds */
+#define IRC_LAG_BUCKETS  ((32 - IRC_LAG_SUB_BITS + 1) * IRC_LAG_SUB)
+
+struct irc_lag_hist {
+	uint32_t ct[IRC_LAG_BUCKETS];
+	unsigned long long samples;
+	/* seconds */
+	double sum;
+	double min;
+	double max;
+};
+
+void irc_lag_hist_reset(struct irc_lag_hist *h);
+/* record a round trip of @secs */
+void irc_lag_hist_add(struct irc_lag_hist *h, double secs);
+/*
+ * The value, in seconds, at or below which a fraction @q (0 to 1, e.g. 0.99)
+ * of the samples fall, to within the bucket resolution.
+ * return: 0 if there are no samples.
+ */
+double irc_lag_hist_quantile(const struct irc_lag_hist *h, double q);
+
+#endif
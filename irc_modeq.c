@@ -0,0 +1,149 @@
+#include "irc_modeq.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ccan/pr_debug/pr_debug.h>
+
+struct modeq_rec {
+	size_t chan_len;
+	size_t arg_len;
+	char sign;
+	char mode;
+	bool done;
+	/* followed by the channel, then the argument */
+};
+
+void irc_modeq_init(struct irc_modeq *q)
+{
+	*q = (struct irc_modeq) {};
+}
+
+void irc_modeq_free(struct irc_modeq *q)
+{
+	free(q->buf);
+	irc_modeq_init(q);
+}
+
+int irc_modeq_add(struct irc_modeq *q,
+		const char *chan, size_t chan_len,
+		char sign, char mode,
+		const char *arg, size_t arg_len)
+{
+	struct modeq_rec rec = {
+		.chan_len = chan_len,
+		.arg_len = arg_len,
+		.sign = sign,
+		.mode = mode,
+	};
+	size_t need = sizeof(rec) + chan_len + arg_len;
+
+	if (q->cap - q->len < need) {
+		size_t cap = q->cap ? q->cap : 512;
+		while (cap - q->len < need)
+			cap *= 2;
+		char *b = realloc(q->buf, cap);
+		if (!b)
+			return -1;
+		q->buf = b;
+		q->cap = cap;
+	}
+
+	char *p = q->buf + q->len;
+	memcpy(p, &rec, sizeof(rec));
+	memcpy(p + sizeof(rec), chan, chan_len);
+	memcpy(p + sizeof(rec) + chan_len, arg, arg_len);
+	q->len += need;
+	q->ct++;
+	return 0;
+}
+
+/* records aren't aligned, so the header is always copied out */
+static size_t rec_size(const char *p)
+{
+	struct modeq_rec rec;
+	memcpy(&rec, p, sizeof(rec));
+	return sizeof(rec) + rec.chan_len + rec.arg_len;
+}
+
+/* "MODE <chan> <modes>[ <args>]" */
+static size_t line_len(size_t chan_len, size_t modes_len, size_t args_len)
+{
+	return strlen("MODE ") + chan_len + 1 + modes_len
+		+ (args_len ? 1 + args_len : 0);
+}
+
+int irc_modeq_flush(struct irc_modeq *q, size_t max_params, size_t line_max,
+		irc_modeq_line_cb cb, void *ctx)
+{
+	char modes[IRC_MODEQ_MAX], args[IRC_MODEQ_MAX];
+	size_t pos, p;
+
+	if (line_max > IRC_MODEQ_MAX)
+		line_max = IRC_MODEQ_MAX;
+	int r = 0;
+
+	for (pos = 0; pos < q->len; pos += rec_size(q->buf + pos)) {
+		struct modeq_rec first;
+		memcpy(&first, q->buf + pos, sizeof(first));
+		if (first.done)
+			continue;
+
+		const char *chan = q->buf + pos + sizeof(first);
+		size_t ml = 0, al = 0, params = 0;
+		char sign = 0;
+
+		/* every later change to the same channel joins this one */
+		for (p = pos; p < q->len;) {
+			struct modeq_rec rec;
+			memcpy(&rec, q->buf + p, sizeof(rec));
+			const char *c = q->buf + p + sizeof(rec);
+			const char *arg = c + rec.chan_len;
+			size_t here = p;
+			p += sizeof(rec) + rec.chan_len + rec.arg_len;
+
+			if (rec.done || rec.chan_len != first.chan_len
+					|| memcmp(c, chan, rec.chan_len))
+				continue;
+
+			rec.done = true;
+			memcpy(q->buf + here, &rec, sizeof(rec));
+
+			size_t add_al = rec.arg_len ? !!al + rec.arg_len : 0;
+			if (ml && ((rec.arg_len && params >= max_params)
+					|| line_len(first.chan_len, ml + (rec.sign != sign) + 1,
+						al + add_al) > line_max)) {
+				if (cb(ctx, chan, first.chan_len, modes, ml, args, al))
+					r = -1;
+				ml = al = params = 0;
+				sign = 0;
+			}
+
+			if (line_len(first.chan_len, 2, rec.arg_len) > line_max) {
+				pr_debug(1, "oversized mode change for %.*s, dropping.",
+						(int)first.chan_len, chan);
+				r = -1;
+				continue;
+			}
+
+			if (rec.sign != sign)
+				modes[ml++] = sign = rec.sign;
+			modes[ml++] = rec.mode;
+			if (rec.arg_len) {
+				if (al)
+					args[al++] = ' ';
+				memcpy(args + al, arg, rec.arg_len);
+				al += rec.arg_len;
+				params++;
+			}
+		}
+
+		if (ml && cb(ctx, chan, first.chan_len, modes, ml, args, al))
+			r = -1;
+	}
+
+	q->len = 0;
+	q->ct = 0;
+	return r;
+}
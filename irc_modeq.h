@@ -0,0 +1,52 @@
+#ifndef IRC_MODEQ_H_
+#define IRC_MODEQ_H_
+
+#include <stddef.h>
+
+/* RFC 2812 servers take 3 parameter modes per MODE, ISUPPORT MODES= says more */
+#define IRC_MODES_DEFAULT 3
+
+/* the longest line irc_modeq_flush() will build, a larger line_max is clamped */
+#define IRC_MODEQ_MAX 512
+
+/*
+ * Channel mode changes collected to be sent together. Each change is stored
+ * as a record with copies of the channel and argument.
+ */
+struct irc_modeq {
+	char *buf;
+	size_t len;
+	size_t cap;
+	/* changes queued */
+	size_t ct;
+};
+
+/* called with a packed "MODE <chan> <modes>[ <args>]" line, less "MODE " */
+typedef int (*irc_modeq_line_cb)(void *ctx,
+		const char *chan, size_t chan_len,
+		const char *modes, size_t modes_len,
+		const char *args, size_t args_len);
+
+void irc_modeq_init(struct irc_modeq *q);
+void irc_modeq_free(struct irc_modeq *q);
+
+/*
+ * Queue a change of @mode on @chan, @sign being '+' or '-'. @arg_len may be 0
+ * for modes without a parameter.
+ */
+int irc_modeq_add(struct irc_modeq *q,
+		const char *chan, size_t chan_len,
+		char sign, char mode,
+		const char *arg, size_t arg_len);
+
+/*
+ * Pack every queued change into as few MODE lines as possible, per channel
+ * and in the order they were queued. Each line has at most @max_params
+ * changes with a parameter, and is at most @line_max (up to IRC_MODEQ_MAX)
+ * bytes long. The queue is empty afterwards.
+ * return: 0, or -1 if any @cb call failed.
+ */
+int irc_modeq_flush(struct irc_modeq *q, size_t max_params, size_t line_max,
+		irc_modeq_line_cb cb, void *ctx);
+
+#endif
@@ -0,0 +1,49 @@
+#include "irc_mpsc.h"
+
+#include <stddef.h>
+
+void irc_mpsc_init(struct irc_mpsc *q)
+{
+	q->stub.next = NULL;
+	q->head = q->tail = &q->stub;
+}
+
+void irc_mpsc_push(struct irc_mpsc *q, struct irc_mpsc_node *n)
+{
+	__atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+	struct irc_mpsc_node *prev = __atomic_exchange_n(&q->head, n,
+			__ATOMIC_ACQ_REL);
+	/* until this store, the consumer sees the queue end at prev */
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+struct irc_mpsc_node *irc_mpsc_pop(struct irc_mpsc *q)
+{
+	struct irc_mpsc_node *tail = q->tail;
+	struct irc_mpsc_node *next = __atomic_load_n(&tail->next,
+			__ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* tail is the last one: put the stub behind it so it can be taken */
+	irc_mpsc_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
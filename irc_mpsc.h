@@ -0,0 +1,27 @@
+#ifndef IRC_MPSC_H_
+#define IRC_MPSC_H_
+
+struct irc_mpsc_node {
+	struct irc_mpsc_node *next;
+};
+
+/* Vyukov's intrusive MPSC queue: any thread pushes, the worker pops */
+struct irc_mpsc {
+	/* most recently pushed, swapped by producers */
+	struct irc_mpsc_node *head;
+	/* next to pop, only touched by the consumer */
+	struct irc_mpsc_node *tail;
+	struct irc_mpsc_node stub;
+};
+
+void irc_mpsc_init(struct irc_mpsc *q);
+/* from any thread */
+void irc_mpsc_push(struct irc_mpsc *q, struct irc_mpsc_node *n);
+/*
+ * From the one consumer thread.
+ * return: NULL if empty, or if a push is half done (the pusher has to wake
+ *         the consumer afterwards, so it comes back for it).
+ */
+struct irc_mpsc_node *irc_mpsc_pop(struct irc_mpsc *q);
+
+#endif
@@ -0,0 +1,152 @@
+#include "irc_outq.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <ccan/array_size/array_size.h>
+
+void irc_outq_init(struct irc_outq *q)
+{
+	*q = (struct irc_outq) {};
+}
+
+void irc_outq_free(struct irc_outq *q)
+{
+	struct irc_oblock *b = q->first;
+	while (b) {
+		struct irc_oblock *next = b->next;
+		free(b);
+		b = next;
+	}
+	free(q->spare);
+	irc_outq_init(q);
+}
+
+char *irc_outq_reserve(struct irc_outq *q, size_t len)
+{
+	if (len > IRC_OUTQ_BLOCK)
+		return NULL;
+
+	struct irc_oblock *b = q->last;
+	if (b && IRC_OUTQ_BLOCK - b->tail >= len)
+		return b->data + b->tail;
+
+	if (q->spare) {
+		b = q->spare;
+		q->spare = NULL;
+	} else {
+		b = malloc(sizeof(*b));
+		if (!b)
+			return NULL;
+	}
+
+	b->next = NULL;
+	b->head = 0;
+	b->tail = 0;
+	if (q->last)
+		q->last->next = b;
+	else
+		q->first = b;
+	q->last = b;
+	return b->data;
+}
+
+void irc_outq_commit(struct irc_outq *q, size_t len)
+{
+	q->last->tail += len;
+	q->len += len;
+}
+
+int irc_outq_append(struct irc_outq *q, const struct iovec *iov, size_t iov_ct)
+{
+	size_t i, len = 0;
+	for (i = 0; i < iov_ct; i++)
+		len += iov[i].iov_len;
+
+	char *p = irc_outq_reserve(q, len);
+	if (!p)
+		return -1;
+
+	for (i = 0; i < iov_ct; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	irc_outq_commit(q, len);
+	return 0;
+}
+
+void irc_outq_consume(struct irc_outq *q, size_t len)
+{
+	q->len -= len;
+	while (len) {
+		struct irc_oblock *b = q->first;
+		size_t n = b->tail - b->head;
+		if (len < n) {
+			b->head += len;
+			return;
+		}
+
+		len -= n;
+		q->first = b->next;
+		if (!q->first)
+			q->last = NULL;
+		if (q->spare)
+			free(b);
+		else
+			q->spare = b;
+	}
+}
+
+char *irc_outq_peek(struct irc_outq *q, size_t *len)
+{
+	struct irc_oblock *b = q->first;
+	if (!b) {
+		*len = 0;
+		return NULL;
+	}
+
+	*len = b->tail - b->head;
+	return b->data + b->head;
+}
+
+size_t irc_outq_iov(struct irc_outq *q, struct iovec *iov, size_t iov_max)
+{
+	size_t ct = 0;
+	struct irc_oblock *b;
+	for (b = q->first; b && ct < iov_max; b = b->next)
+		iov[ct++] = (struct iovec){ b->data + b->head, b->tail - b->head };
+	return ct;
+}
+
+ssize_t irc_outq_flush(struct irc_outq *q, int fd)
+{
+	ssize_t total = 0;
+
+	while (q->len) {
+		struct iovec iov[64];
+		size_t i, want = 0, ct = irc_outq_iov(q, iov, ARRAY_SIZE(iov));
+		for (i = 0; i < ct; i++)
+			want += iov[i].iov_len;
+
+		ssize_t r = writev(fd, iov, ct);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (total && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return total;
+			return -1;
+		}
+
+		irc_outq_consume(q, r);
+		total += r;
+
+		/* a short write means the socket is full */
+		if ((size_t)r < want)
+			break;
+	}
+
+	return total;
+}
@@ -0,0 +1,68 @@
+#ifndef IRC_OUTQ_H_
+#define IRC_OUTQ_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* bytes per block, a single append must fit in one block */
+#define IRC_OUTQ_BLOCK 4096
+
+struct irc_oblock {
+	struct irc_oblock *next;
+	/* data[head..tail) is waiting to be written */
+	size_t head;
+	size_t tail;
+	char data[IRC_OUTQ_BLOCK];
+};
+
+/*
+ * Output queue. Lines are appended to a list of blocks, and written out
+ * with a single writev() covering every block.
+ */
+struct irc_outq {
+	struct irc_oblock *first;
+	struct irc_oblock *last;
+	/* bytes waiting to be written */
+	size_t len;
+	/* one emptied block is kept around to avoid malloc churn */
+	struct irc_oblock *spare;
+};
+
+void irc_outq_init(struct irc_outq *q);
+void irc_outq_free(struct irc_outq *q);
+
+/*
+ * Get @len contiguous bytes at the end of the queue to write into. They are
+ * not queued until irc_outq_commit() is called.
+ * return: NULL if @len > IRC_OUTQ_BLOCK or allocation failed.
+ */
+char *irc_outq_reserve(struct irc_outq *q, size_t len);
+void irc_outq_commit(struct irc_outq *q, size_t len);
+
+/* queue the concatenation of @iov, kept contiguous */
+int irc_outq_append(struct irc_outq *q, const struct iovec *iov, size_t iov_ct);
+
+/*
+ * The contiguous bytes at the front of the queue. Anything queued by a single
+ * irc_outq_append() is never split, so it is either all here or not at all.
+ * return: NULL if the queue is empty.
+ */
+char *irc_outq_peek(struct irc_outq *q, size_t *len);
+/* drop @len bytes from the front of the queue */
+void irc_outq_consume(struct irc_outq *q, size_t len);
+
+/*
+ * Point @iov at the queued bytes, front first, for a write done elsewhere
+ * (which then calls irc_outq_consume()). Appending doesn't disturb them.
+ * return: how many of @iov were used.
+ */
+size_t irc_outq_iov(struct irc_outq *q, struct iovec *iov, size_t iov_max);
+
+/*
+ * Write as much as possible to @fd, resuming after any short write.
+ * return: bytes written, or -1 with errno set.
+ */
+ssize_t irc_outq_flush(struct irc_outq *q, int fd);
+
+#endif
@@ -0,0 +1,250 @@
+#include "irc_runtime.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ccan/container_of/container_of.h>
+#include <ccan/err/err.h>
+#include <ccan/pr_debug/pr_debug.h>
+
+struct rt_msg {
+	struct irc_mpsc_node node;
+	void (*run)(struct irc_worker *w, struct rt_msg *m);
+	struct irc_connection *c;
+	irc_runtime_fn fn;
+	void *arg;
+	int fd;
+	size_t len;
+	char data[];
+};
+
+static void wake_cb(EV_P_ ev_async *a, int revents)
+{
+	struct irc_worker *w = container_of(a, typeof(*w), wake);
+	struct irc_mpsc_node *n;
+	while ((n = irc_mpsc_pop(&w->q))) {
+		struct rt_msg *m = container_of(n, struct rt_msg, node);
+		m->run(w, m);
+		free(m);
+	}
+
+	if (__atomic_load_n(&w->stopping, __ATOMIC_ACQUIRE)) {
+		irc_registry_disconnect_all(&w->reg);
+		ev_break(EV_A_ EVBREAK_ALL);
+	}
+}
+
+static struct rt_msg *msg_new(size_t len)
+{
+	struct rt_msg *m = malloc(sizeof(*m) + len);
+	if (!m)
+		return NULL;
+	memset(m, 0, sizeof(*m));
+	m->len = len;
+	return m;
+}
+
+static void msg_send(struct irc_worker *w, struct rt_msg *m)
+{
+	irc_mpsc_push(&w->q, &m->node);
+	ev_async_send(w->loop, &w->wake);
+}
+
+static struct irc_worker *worker_of(struct irc_connection *c)
+{
+	return ev_userdata(c->loop);
+}
+
+static void run_add(struct irc_worker *w, struct rt_msg *m)
+{
+	struct irc_connection *c = m->c;
+	irc_init(c);
+	irc_registry_add(&w->reg, c);
+	if (m->fd >= 0)
+		irc_connect_fd(c, m->fd);
+	else if (irc_connect(c))
+		warnx("could not start connecting to %s:%s", c->server, c->port);
+}
+
+static void run_call(struct irc_worker *w, struct rt_msg *m)
+{
+	m->fn(m->c, m->arg);
+}
+
+static void run_cmd(struct irc_worker *w, struct rt_msg *m)
+{
+	struct arg line = { m->data, m->len };
+	irc_cmd_spans(m->c, &line, 1);
+}
+
+static void run_remove(struct irc_worker *w, struct rt_msg *m)
+{
+	irc_disconnect(m->c);
+	irc_registry_remove(m->c);
+	__atomic_fetch_sub(&w->load, 1, __ATOMIC_RELAXED);
+	if (m->fn)
+		m->fn(m->c, m->arg);
+}
+
+static bool worker_has(struct irc_worker *w, struct irc_connection *c)
+{
+	struct irc_connection *i;
+	irc_registry_for_each(&w->reg, i)
+		if (i == c)
+			return true;
+	return false;
+}
+
+static void *worker_thread(void *w_)
+{
+	struct irc_worker *w = w_;
+	ev_run(w->loop, 0);
+	return NULL;
+}
+
+static int worker_start(struct irc_runtime *rt, struct irc_worker *w)
+{
+	*w = (struct irc_worker) { .rt = rt };
+	w->loop = ev_loop_new(EVFLAG_AUTO);
+	if (!w->loop)
+		return -1;
+
+	ev_set_userdata(w->loop, w);
+	irc_mpsc_init(&w->q);
+	irc_registry_init(&w->reg);
+	ev_async_init(&w->wake, wake_cb);
+	ev_async_start(w->loop, &w->wake);
+
+	int r = pthread_create(&w->thread, NULL, worker_thread, w);
+	if (r) {
+		errno = r;
+		warn("could not start a worker");
+		ev_loop_destroy(w->loop);
+		return -1;
+	}
+	return 0;
+}
+
+int irc_runtime_init(struct irc_runtime *rt, size_t workers)
+{
+	if (!workers) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = n > 0 ? n : 1;
+	}
+
+	rt->w = calloc(workers, sizeof(*rt->w));
+	if (!rt->w)
+		return -1;
+
+	for (rt->ct = 0; rt->ct < workers; rt->ct++)
+		if (worker_start(rt, &rt->w[rt->ct]))
+			break;
+
+	pr_debug(1, "runtime: %zu of %zu workers started", rt->ct, workers);
+	if (!rt->ct) {
+		free(rt->w);
+		return -1;
+	}
+	return 0;
+}
+
+void irc_runtime_stop(struct irc_runtime *rt)
+{
+	size_t i;
+	for (i = 0; i < rt->ct; i++) {
+		struct irc_worker *w = &rt->w[i];
+		__atomic_store_n(&w->stopping, 1, __ATOMIC_RELEASE);
+		ev_async_send(w->loop, &w->wake);
+	}
+
+	for (i = 0; i < rt->ct; i++) {
+		struct irc_worker *w = &rt->w[i];
+		pthread_join(w->thread, NULL);
+
+		/* anything sent after the stop is dropped, except that removes
+		 * still finish so whoever asked gets their done callback */
+		struct irc_mpsc_node *n;
+		while ((n = irc_mpsc_pop(&w->q))) {
+			struct rt_msg *m = container_of(n, struct rt_msg, node);
+			if (m->run == run_remove) {
+				if (worker_has(w, m->c))
+					run_remove(w, m);
+				else if (m->fn)
+					m->fn(m->c, m->arg);
+			}
+			free(m);
+		}
+		ev_loop_destroy(w->loop);
+	}
+
+	free(rt->w);
+	rt->w = NULL;
+	rt->ct = 0;
+}
+
+int irc_runtime_add(struct irc_runtime *rt, struct irc_connection *c, int fd)
+{
+	struct irc_worker *w = &rt->w[0];
+	size_t i, least = __atomic_load_n(&w->load, __ATOMIC_RELAXED);
+	for (i = 1; i < rt->ct && least; i++) {
+		size_t l = __atomic_load_n(&rt->w[i].load, __ATOMIC_RELAXED);
+		if (l < least) {
+			least = l;
+			w = &rt->w[i];
+		}
+	}
+
+	struct rt_msg *m = msg_new(0);
+	if (!m)
+		return -1;
+	m->run = run_add;
+	m->c = c;
+	m->fd = fd;
+
+	c->loop = w->loop;
+	__atomic_fetch_add(&w->load, 1, __ATOMIC_RELAXED);
+	msg_send(w, m);
+	return 0;
+}
+
+int irc_runtime_call(struct irc_connection *c, irc_runtime_fn fn, void *arg)
+{
+	struct rt_msg *m = msg_new(0);
+	if (!m)
+		return -1;
+	m->run = run_call;
+	m->c = c;
+	m->fn = fn;
+	m->arg = arg;
+	msg_send(worker_of(c), m);
+	return 0;
+}
+
+int irc_runtime_cmd(struct irc_connection *c, const char *msg, size_t msg_len)
+{
+	struct rt_msg *m = msg_new(msg_len);
+	if (!m)
+		return -1;
+	m->run = run_cmd;
+	m->c = c;
+	memcpy(m->data, msg, msg_len);
+	msg_send(worker_of(c), m);
+	return 0;
+}
+
+int irc_runtime_remove(struct irc_connection *c, irc_runtime_fn done,
+		void *arg)
+{
+	struct rt_msg *m = msg_new(0);
+	if (!m)
+		return -1;
+	m->run = run_remove;
+	m->c = c;
+	m->fn = done;
+	m->arg = arg;
+	msg_send(worker_of(c), m);
+	return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef IRC_RUNTIME_H_
+#define IRC_RUNTIME_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <ev.h>
+
+#include "irc.h"
+#include "irc_mpsc.h"
+
+/*
+ * Connections spread over a number of worker threads, each running its own
+ * ev_loop with its own irc_registry.
+ *
+ * Once handed to irc_runtime_add() a connection belongs to its worker: every
+ * callback (handlers, on_close, ...) runs on that thread, and other threads
+ * may only reach it through irc_runtime_call(), irc_runtime_cmd() and
+ * irc_runtime_remove(). Those queue a message on a lock-free MPSC queue and
+ * wake the worker with an ev_async, so they never block on it.
+ */
+
+struct irc_worker {
+	struct irc_runtime *rt;
+	pthread_t thread;
+	struct ev_loop *loop;
+	ev_async wake;
+	struct irc_mpsc q;
+
+	/* only touched from the worker's thread */
+	struct irc_registry reg;
+
+	/* connections assigned here (including ones still on their way), read
+	 * by irc_runtime_add() to pick the least loaded worker */
+	size_t load;
+	/* set by irc_runtime_stop() */
+	int stopping;
+};
+
+struct irc_runtime {
+	struct irc_worker *w;
+	size_t ct;
+};
+
+/* called on the connection's worker */
+typedef void (*irc_runtime_fn)(struct irc_connection *c, void *arg);
+
+/*
+ * Start @workers threads, one per online CPU if 0.
+ * return: 0, or -1 if not even one could be started.
+ */
+int irc_runtime_init(struct irc_runtime *rt, size_t workers);
+/*
+ * Disconnect every connection, then stop & join the workers. Connections are
+ * not freed, they are the caller's. Messages still queued are dropped, except
+ * for irc_runtime_remove()s: those still call their @done, from this thread.
+ */
+void irc_runtime_stop(struct irc_runtime *rt);
+
+/*
+ * Hand @c (filled in, but not yet irc_init()ed) to the least loaded worker,
+ * which initializes it and connects it: to @fd if it is >= 0, otherwise to
+ * c->server:c->port. c->loop is overwritten.
+ * return: 0, or -1 if the message couldn't be allocated.
+ */
+int irc_runtime_add(struct irc_runtime *rt, struct irc_connection *c, int fd);
+/* run @fn(@c, @arg) on @c's worker */
+int irc_runtime_call(struct irc_connection *c, irc_runtime_fn fn, void *arg);
+/* send one line (without the "\r\n") from any thread, @msg is copied */
+int irc_runtime_cmd(struct irc_connection *c, const char *msg, size_t msg_len);
+/*
+ * Disconnect @c and take it off its worker, then call @done (if not NULL)
+ * there, after which @c is the caller's again and may be freed.
+ */
+int irc_runtime_remove(struct irc_connection *c, irc_runtime_fn done,
+		void *arg);
+
+#endif
@@ -0,0 +1,59 @@
+#include "irc_scan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define SCAN_WIDTH 32
+static uint32_t scan_mask(const char *p)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	return (uint32_t)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+}
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+# define SCAN_WIDTH 16
+static uint32_t scan_mask(const char *p)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	return (uint32_t)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+}
+#endif
+
+size_t irc_scan_lines(const char *buf, size_t len, size_t *ends,
+		size_t max_ends)
+{
+	size_t ct = 0;
+	size_t pos = 0;
+
+	if (!max_ends)
+		return 0;
+
+#ifdef SCAN_WIDTH
+	for (; pos + SCAN_WIDTH <= len; pos += SCAN_WIDTH) {
+		uint32_t mask = scan_mask(buf + pos);
+		while (mask) {
+			ends[ct++] = pos + __builtin_ctz(mask);
+			if (ct == max_ends)
+				return ct;
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	/* tail (or everything, without simd) */
+	while (pos < len) {
+		const char *nl = memchr(buf + pos, '\n', len - pos);
+		if (!nl)
+			break;
+		ends[ct++] = nl - buf;
+		if (ct == max_ends)
+			return ct;
+		pos = nl - buf + 1;
+	}
+
+	return ct;
+}
@@ -0,0 +1,23 @@
+#ifndef IRC_SCAN_H_
+#define IRC_SCAN_H_
+
+#include <stddef.h>
+
+/*
+ * Locate every line terminator in @buf in a single pass.
+ *
+ * The offset (from @buf) of each '\n' is stored in @ends, in order, until
+ * either @len bytes have been examined or @max_ends offsets have been
+ * stored. Both "\r\n" and a bare "\n" terminate a line, stripping the '\r'
+ * is left to the caller.
+ *
+ * Uses AVX2 or SSE2 when the compiler is targeting them (-mavx2, or any
+ * x86_64 for SSE2), and a memchr() loop otherwise.
+ *
+ * return: the number of offsets stored in @ends. If this equals @max_ends,
+ *         scanning may be resumed at @ends[@max_ends - 1] + 1.
+ */
+size_t irc_scan_lines(const char *buf, size_t len, size_t *ends,
+		size_t max_ends);
+
+#endif
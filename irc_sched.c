@@ -0,0 +1,155 @@
+#include "irc_sched.h"
+
+#include <string.h>
+
+struct irc_sched_rec {
+	double queued;
+	size_t len;
+};
+
+void irc_sched_init(struct irc_sched *s, double rate, double burst)
+{
+	size_t i;
+	*s = (struct irc_sched) {
+		.rate = rate,
+		.burst = burst < 1 ? 1 : burst,
+	};
+	s->tokens = s->burst;
+
+	for (i = 0; i < IRC_PRIO_CT; i++)
+		irc_outq_init(&s->cls[i].q);
+}
+
+void irc_sched_free(struct irc_sched *s)
+{
+	size_t i;
+	for (i = 0; i < IRC_PRIO_CT; i++) {
+		irc_outq_free(&s->cls[i].q);
+		s->cls[i].depth = 0;
+	}
+}
+
+char *irc_sched_reserve(struct irc_sched *s, enum irc_prio prio, double now,
+		size_t len)
+{
+	struct irc_sched_rec rec = { .queued = now, .len = len };
+	char *p = irc_outq_reserve(&s->cls[prio].q, sizeof(rec) + len);
+	if (!p)
+		return NULL;
+
+	memcpy(p, &rec, sizeof(rec));
+	return p + sizeof(rec);
+}
+
+void irc_sched_commit(struct irc_sched *s, enum irc_prio prio, size_t len)
+{
+	struct irc_sched_class *k = &s->cls[prio];
+	irc_outq_commit(&k->q, sizeof(struct irc_sched_rec) + len);
+
+	k->depth++;
+	k->enqueued++;
+	if (k->depth > k->max_depth)
+		k->max_depth = k->depth;
+}
+
+int irc_sched_push(struct irc_sched *s, enum irc_prio prio, double now,
+		const char *msg, size_t len)
+{
+	char *p = irc_sched_reserve(s, prio, now, len);
+	if (!p)
+		return -1;
+
+	memcpy(p, msg, len);
+	irc_sched_commit(s, prio, len);
+	return 0;
+}
+
+static void sched_refill(struct irc_sched *s, double now)
+{
+	if (now > s->last) {
+		s->tokens += (now - s->last) * s->rate;
+		if (s->tokens > s->burst)
+			s->tokens = s->burst;
+	}
+	s->last = now;
+}
+
+size_t irc_sched_run(struct irc_sched *s, double now, struct irc_outq *out)
+{
+	size_t moved = 0, i = 0;
+
+	sched_refill(s, now);
+	while (i < IRC_PRIO_CT) {
+		struct irc_sched_class *k = &s->cls[i];
+		if (!k->depth) {
+			i++;
+			continue;
+		}
+
+		if (s->rate && s->tokens < 1)
+			break;
+
+		size_t avail;
+		char *p = irc_outq_peek(&k->q, &avail);
+		struct irc_sched_rec rec;
+		memcpy(&rec, p, sizeof(rec));
+
+		struct iovec iov = { p + sizeof(rec), rec.len };
+		if (irc_outq_append(out, &iov, 1))
+			break;
+		irc_outq_consume(&k->q, sizeof(rec) + rec.len);
+
+		double wait = now - rec.queued;
+		k->depth--;
+		k->sent++;
+		k->wait_total += wait;
+		if (wait > k->wait_max)
+			k->wait_max = wait;
+
+		if (s->rate)
+			s->tokens -= 1;
+		moved++;
+	}
+
+	return moved;
+}
+
+double irc_sched_delay(struct irc_sched *s, double now)
+{
+	if (!irc_sched_depth(s))
+		return -1;
+	if (!s->rate)
+		return 0;
+
+	sched_refill(s, now);
+	if (s->tokens >= 1)
+		return 0;
+	return (1 - s->tokens) / s->rate;
+}
+
+size_t irc_sched_depth(const struct irc_sched *s)
+{
+	size_t i, d = 0;
+	for (i = 0; i < IRC_PRIO_CT; i++)
+		d += s->cls[i].depth;
+	return d;
+}
+
+void irc_sched_for_each(const struct irc_sched *s,
+		void (*cb)(void *ctx, const char *line, size_t len), void *ctx)
+{
+	size_t i;
+	for (i = 0; i < IRC_PRIO_CT; i++) {
+		/* records never straddle blocks */
+		const struct irc_oblock *b;
+		for (b = s->cls[i].q.first; b; b = b->next) {
+			size_t at = b->head;
+			while (at < b->tail) {
+				struct irc_sched_rec rec;
+				memcpy(&rec, b->data + at, sizeof(rec));
+				cb(ctx, b->data + at + sizeof(rec), rec.len);
+				at += sizeof(rec) + rec.len;
+			}
+		}
+	}
+}
@@ -0,0 +1,87 @@
+#ifndef IRC_SCHED_H_
+#define IRC_SCHED_H_
+
+#include <stddef.h>
+#include "irc_outq.h"
+
+/* lower values are sent first */
+enum irc_prio {
+	/* PONG, registration, QUIT: late ones get us disconnected */
+	IRC_PRIO_URGENT,
+	/* JOIN, PART, MODE, KICK, ... */
+	IRC_PRIO_CONTROL,
+	/* PRIVMSG, NOTICE and anything not otherwise known */
+	IRC_PRIO_BULK,
+	IRC_PRIO_CT
+};
+
+/* defaults for the send pacing, like most clients: 5 at once, then 1 every 2s */
+#define IRC_SEND_BURST 5
+#define IRC_SEND_RATE  0.5
+
+struct irc_sched_class {
+	/* records of (struct irc_sched_rec, line) waiting for a token */
+	struct irc_outq q;
+
+	/* lines currently queued */
+	size_t depth;
+	size_t max_depth;
+	/* lines ever queued / handed to the output queue */
+	unsigned long long enqueued;
+	unsigned long long sent;
+	/* seconds spent queued by the lines that have been sent */
+	double wait_total;
+	double wait_max;
+};
+
+/*
+ * Token bucket send scheduler. Every line costs one token, tokens refill at
+ * @rate per second up to @burst, and lines are released strictly by class.
+ */
+struct irc_sched {
+	/* lines per second, 0 sends everything immediately */
+	double rate;
+	double burst;
+
+	double tokens;
+	double last;
+
+	struct irc_sched_class cls[IRC_PRIO_CT];
+};
+
+void irc_sched_init(struct irc_sched *s, double rate, double burst);
+void irc_sched_free(struct irc_sched *s);
+
+/*
+ * Queue @msg in class @prio at time @now.
+ * return: 0 on success, -1 if it could not be queued.
+ */
+int irc_sched_push(struct irc_sched *s, enum irc_prio prio, double now,
+		const char *msg, size_t len);
+
+/*
+ * Space for a @len byte line in class @prio, queued at @now once
+ * irc_sched_commit() is called with the same @prio and @len.
+ * return: NULL if it could not be queued.
+ */
+char *irc_sched_reserve(struct irc_sched *s, enum irc_prio prio, double now,
+		size_t len);
+void irc_sched_commit(struct irc_sched *s, enum irc_prio prio, size_t len);
+
+/*
+ * Move every line the bucket allows at @now to @out.
+ * return: the number of lines moved.
+ */
+size_t irc_sched_run(struct irc_sched *s, double now, struct irc_outq *out);
+
+/* seconds from @now until the next line may go out, or < 0 if none is queued */
+double irc_sched_delay(struct irc_sched *s, double now);
+
+/* lines queued in every class */
+size_t irc_sched_depth(const struct irc_sched *s);
+
+/* call @cb on every queued line, in the order they would be sent */
+void irc_sched_for_each(const struct irc_sched *s,
+		void (*cb)(void *ctx, const char *line, size_t len), void *ctx);
+
+#endif
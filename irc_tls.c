@@ -0,0 +1,430 @@
+#include "irc_tls.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include <ccan/array_size/array_size.h>
+#include <ccan/container_of/container_of.h>
+#include <ccan/err/err.h>
+#include <ccan/pr_debug/pr_debug.h>
+#include <penny/penny.h>
+
+#include "irc.h"
+
+struct tls_session {
+	struct list_node node;
+	SSL_SESSION *sess;
+	/* "server\0port\0" */
+	size_t key_len;
+	char key[];
+};
+
+struct tls_conn {
+	struct irc_connection *c;
+	SSL *ssl;
+	ev_io w;
+	bool connected;
+
+	/* set while handlers we call might detach us, which then only marks
+	 * us dead and leaves the freeing to tls_cb() */
+	bool busy;
+	bool dead;
+
+	/* a record's worth of queued output, held until SSL_write() takes it.
+	 * Only allocated while there is some. */
+	size_t rec_len;
+	char *rec;
+};
+
+static void tls_warn(const char *what)
+{
+	unsigned long e = ERR_get_error();
+	warnx("tls: %s: %s", what,
+			e ? ERR_reason_error_string(e) : "unknown error");
+	ERR_clear_error();
+}
+
+static void tls_error(struct tls_conn *tc, const char *what, int e)
+{
+	long v;
+	switch (e) {
+	case SSL_ERROR_SYSCALL:
+		if (errno)
+			warn("tls: %s", what);
+		else
+			warnx("tls: %s: unexpected EOF", what);
+		ERR_clear_error();
+		break;
+	case SSL_ERROR_SSL:
+		v = SSL_get_verify_result(tc->ssl);
+		if (v != X509_V_OK) {
+			warnx("tls: %s: certificate: %s", what,
+					X509_verify_cert_error_string(v));
+			ERR_clear_error();
+		} else {
+			tls_warn(what);
+		}
+		break;
+	default:
+		warnx("tls: %s failed (%d)", what, e);
+		ERR_clear_error();
+	}
+}
+
+static struct irc_tls *tls_of(struct irc_connection *c)
+{
+	return container_of(c->io, struct irc_tls, io);
+}
+
+/* with t->lock held */
+static struct tls_session *session_find(struct irc_tls *t,
+		struct irc_connection *c)
+{
+	size_t sl = strlen(c->server), pl = strlen(c->port);
+	struct tls_session *s;
+	list_for_each(&t->sessions, s, node) {
+		if (s->key_len == sl + pl + 2
+				&& !memcmp(s->key, c->server, sl + 1)
+				&& !memcmp(s->key + sl + 1, c->port, pl + 1))
+			return s;
+	}
+	return NULL;
+}
+
+/* the server handed out a session, keep it for the next connect */
+static int tls_new_session(SSL *ssl, SSL_SESSION *sess)
+{
+	struct irc_connection *c = SSL_get_app_data(ssl);
+	struct irc_tls *t = tls_of(c);
+	if (!c->server || !c->port)
+		return 0;
+
+	pthread_mutex_lock(&t->lock);
+	struct tls_session *s = session_find(t, c);
+	if (s) {
+		SSL_SESSION_free(s->sess);
+	} else {
+		size_t sl = strlen(c->server), pl = strlen(c->port);
+		s = malloc(sizeof(*s) + sl + pl + 2);
+		if (!s) {
+			pthread_mutex_unlock(&t->lock);
+			return 0;
+		}
+		s->key_len = sl + pl + 2;
+		memcpy(s->key, c->server, sl + 1);
+		memcpy(s->key + sl + 1, c->port, pl + 1);
+		list_add(&t->sessions, &s->node);
+	}
+	s->sess = sess;
+	pthread_mutex_unlock(&t->lock);
+
+	/* we keep the reference */
+	return 1;
+}
+
+static void session_resume(struct irc_tls *t, struct tls_conn *tc)
+{
+	struct irc_connection *c = tc->c;
+	if (!c->server || !c->port)
+		return;
+
+	pthread_mutex_lock(&t->lock);
+	struct tls_session *s = session_find(t, c);
+	if (s && SSL_SESSION_is_resumable(s->sess))
+		SSL_set_session(tc->ssl, s->sess);
+	pthread_mutex_unlock(&t->lock);
+}
+
+static void tls_want(struct tls_conn *tc, int events)
+{
+	if (tc->w.events == events && ev_is_active(&tc->w))
+		return;
+	ev_io_stop(tc->c->loop, &tc->w);
+	ev_io_set(&tc->w, tc->c->fd, events);
+	ev_io_start(tc->c->loop, &tc->w);
+}
+
+static int tls_handshake(struct tls_conn *tc)
+{
+	int r = SSL_connect(tc->ssl);
+	if (r <= 0) {
+		int e = SSL_get_error(tc->ssl, r);
+		if (e == SSL_ERROR_WANT_READ) {
+			tls_want(tc, EV_READ);
+			return 0;
+		}
+		if (e == SSL_ERROR_WANT_WRITE) {
+			tls_want(tc, EV_READ | EV_WRITE);
+			return 0;
+		}
+		tls_error(tc, "handshake", e);
+		return -1;
+	}
+
+	tc->connected = true;
+	pr_debug(1, "tls: %s %s%s%s", SSL_get_version(tc->ssl),
+			SSL_get_cipher(tc->ssl),
+			SSL_session_reused(tc->ssl) ? ", resumed" : "",
+#ifdef SSL_OP_ENABLE_KTLS
+			BIO_get_ktls_send(SSL_get_wbio(tc->ssl)) ? ", ktls" :
+#endif
+			"");
+	return 0;
+}
+
+/*
+ * Decrypt into the input buffer until OpenSSL has nothing more.
+ * return: 0, or -1 if the link is gone.
+ */
+static int tls_read(struct tls_conn *tc, int *events)
+{
+	struct irc_connection *c = tc->c;
+	for (;;) {
+		struct iovec iov[2];
+		size_t n;
+		if (irc_io_prepare(c, iov) < 0) {
+			warnx("could not allocate input buffer");
+			return 0;
+		}
+
+		if (!SSL_read_ex(tc->ssl, iov[0].iov_base, iov[0].iov_len, &n)) {
+			int e = SSL_get_error(tc->ssl, 0);
+			if (e == SSL_ERROR_WANT_READ) {
+				irc_io_read_done(c);
+				return 0;
+			}
+			if (e == SSL_ERROR_WANT_WRITE) {
+				*events |= EV_WRITE;
+				irc_io_read_done(c);
+				return 0;
+			}
+			if (e != SSL_ERROR_ZERO_RETURN)
+				tls_error(tc, "read", e);
+			return -1;
+		}
+
+		irc_io_commit(c, n);
+		if (tc->dead)
+			return -1;
+	}
+}
+
+/*
+ * Encrypt queued output a record at a time.
+ * return: 0, or -1 if the link is gone.
+ */
+static int tls_write(struct tls_conn *tc, int *events)
+{
+	struct irc_connection *c = tc->c;
+	for (;;) {
+		if (!tc->rec_len) {
+			if (!c->out.len) {
+				free(tc->rec);
+				tc->rec = NULL;
+				return 0;
+			}
+			if (!tc->rec && !(tc->rec = malloc(IRC_TLS_RECORD))) {
+				warnx("tls: could not allocate a record");
+				return 0;
+			}
+
+			struct iovec iov[8];
+			size_t i, ct = irc_outq_iov(&c->out, iov, ARRAY_SIZE(iov));
+			for (i = 0; i < ct && tc->rec_len < IRC_TLS_RECORD; i++) {
+				size_t n = MIN(iov[i].iov_len,
+						IRC_TLS_RECORD - tc->rec_len);
+				memcpy(tc->rec + tc->rec_len, iov[i].iov_base, n);
+				tc->rec_len += n;
+			}
+			irc_outq_consume(&c->out, tc->rec_len);
+		}
+
+		size_t n;
+		if (SSL_write_ex(tc->ssl, tc->rec, tc->rec_len, &n)) {
+			tc->rec_len = 0;
+			continue;
+		}
+
+		int e = SSL_get_error(tc->ssl, 0);
+		if (e == SSL_ERROR_WANT_WRITE) {
+			*events |= EV_WRITE;
+			return 0;
+		}
+		if (e == SSL_ERROR_WANT_READ)
+			return 0;
+		tls_error(tc, "write", e);
+		return -1;
+	}
+}
+
+static void tls_conn_free(struct tls_conn *tc)
+{
+	SSL_free(tc->ssl);
+	free(tc->rec);
+	free(tc);
+}
+
+static void tls_cb(EV_P_ ev_io *w, int revents)
+{
+	struct tls_conn *tc = container_of(w, typeof(*tc), w);
+	struct irc_connection *c = tc->c;
+	int events = EV_READ;
+
+	if (!tc->connected) {
+		if (tls_handshake(tc))
+			goto closed;
+		if (!tc->connected)
+			return;
+	}
+
+	tc->busy = true;
+	int r = tls_read(tc, &events);
+	tc->busy = false;
+	if (tc->dead) {
+		tls_conn_free(tc);
+		return;
+	}
+	if (r)
+		goto closed;
+
+	if (tls_write(tc, &events))
+		goto closed;
+
+	tls_want(tc, events);
+	return;
+
+closed:
+	irc_io_closed(c);
+}
+
+static int tls_attach(struct irc_connection *c)
+{
+	struct irc_tls *t = tls_of(c);
+	struct tls_conn *tc = malloc(sizeof(*tc));
+	if (!tc) {
+		warnx("tls: could not attach fd %d", c->fd);
+		return -1;
+	}
+	*tc = (struct tls_conn) { .c = c };
+
+	int fl = fcntl(c->fd, F_GETFL);
+	if (fl == -1 || fcntl(c->fd, F_SETFL, fl | O_NONBLOCK) == -1)
+		warn("could not make fd %d non-blocking", c->fd);
+
+	tc->ssl = SSL_new(t->ctx);
+	if (!tc->ssl || !SSL_set_fd(tc->ssl, c->fd)) {
+		tls_warn("could not set up a connection");
+		if (tc->ssl)
+			SSL_free(tc->ssl);
+		free(tc);
+		return -1;
+	}
+	SSL_set_app_data(tc->ssl, c);
+	SSL_set_connect_state(tc->ssl);
+
+	if (c->server) {
+		SSL_set_tlsext_host_name(tc->ssl, c->server);
+		if (t->verify)
+			SSL_set1_host(tc->ssl, c->server);
+	}
+	SSL_set_verify(tc->ssl, t->verify ? SSL_VERIFY_PEER : SSL_VERIFY_NONE,
+			NULL);
+	session_resume(t, tc);
+
+	c->io_priv = tc;
+	/* the handshake starts once the loop comes around */
+	ev_io_init(&tc->w, tls_cb, c->fd, EV_READ | EV_WRITE);
+	ev_io_start(c->loop, &tc->w);
+	return 0;
+}
+
+static void tls_detach(struct irc_connection *c)
+{
+	struct tls_conn *tc = c->io_priv;
+	if (!tc)
+		return;
+
+	c->io_priv = NULL;
+	ev_io_stop(c->loop, &tc->w);
+	/* best effort, we won't wait for the reply */
+	if (tc->connected)
+		SSL_shutdown(tc->ssl);
+	ERR_clear_error();
+
+	if (tc->busy)
+		tc->dead = true;
+	else
+		tls_conn_free(tc);
+}
+
+static void tls_kick(struct irc_connection *c)
+{
+	struct tls_conn *tc = c->io_priv;
+	/* queued output waits for the handshake */
+	if (tc && tc->connected)
+		tls_want(tc, EV_READ | EV_WRITE);
+}
+
+static bool tls_active(struct irc_connection *c)
+{
+	return c->io_priv;
+}
+
+int irc_tls_init(struct irc_tls *t)
+{
+	*t = (struct irc_tls) {
+		.io = {
+			.name = "tls",
+			.attach = tls_attach,
+			.detach = tls_detach,
+			.kick = tls_kick,
+			.active = tls_active,
+		},
+		.verify = true,
+	};
+
+	t->ctx = SSL_CTX_new(TLS_client_method());
+	if (!t->ctx) {
+		tls_warn("could not create a context");
+		return -1;
+	}
+
+	SSL_CTX_set_min_proto_version(t->ctx, TLS1_2_VERSION);
+	if (!SSL_CTX_set_default_verify_paths(t->ctx))
+		tls_warn("could not load the default CA certificates");
+
+	/* idle connections shouldn't each hold on to 2 record buffers */
+	SSL_CTX_set_mode(t->ctx, SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(t->ctx, SSL_OP_ENABLE_KTLS);
+#endif
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	/* plenty of servers just close the socket. A truncated line is
+	 * dropped anyway. */
+	SSL_CTX_set_options(t->ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+	SSL_CTX_set_session_cache_mode(t->ctx,
+			SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(t->ctx, tls_new_session);
+
+	pthread_mutex_init(&t->lock, NULL);
+	list_head_init(&t->sessions);
+	return 0;
+}
+
+void irc_tls_free(struct irc_tls *t)
+{
+	struct tls_session *s, *next;
+	list_for_each_safe(&t->sessions, s, next, node) {
+		SSL_SESSION_free(s->sess);
+		free(s);
+	}
+	pthread_mutex_destroy(&t->lock);
+	SSL_CTX_free(t->ctx);
+}
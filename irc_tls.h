@@ -0,0 +1,51 @@
+#ifndef IRC_TLS_H_
+#define IRC_TLS_H_
+
+#ifndef NO_TLS
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <ccan/list/list.h>
+
+#include "irc_io.h"
+
+/*
+ * TLS for struct irc_connection, as an I/O backend over a non-blocking fd.
+ *
+ * Records are decrypted straight into the connection's input buffer, and
+ * queued output is gathered into full-sized records before being encrypted,
+ * rather than one record per line. The session from the last handshake with
+ * each server:port is kept and offered on the next one, so a reconnect can
+ * skip the full handshake. When OpenSSL and the kernel support kTLS, record
+ * encryption is left to the kernel.
+ *
+ * One struct irc_tls may be shared by any number of connections, on any
+ * number of loops. Use it by setting c->io = &t->io before irc_init().
+ */
+
+/* payload of a full TLS record */
+#define IRC_TLS_RECORD 16384
+
+struct irc_tls {
+	/* what connections point at, leads back here */
+	struct irc_io_ops io;
+	SSL_CTX *ctx;
+
+	/* check the server's certificate against the default CA paths, and its
+	 * name against c->server. Set by irc_tls_init(), clear it to accept
+	 * anything. */
+	bool verify;
+
+	/* guards sessions */
+	pthread_mutex_t lock;
+	struct list_head sessions;
+};
+
+/* return: 0, or -1 if the SSL_CTX couldn't be set up */
+int irc_tls_init(struct irc_tls *t);
+/* every connection using @t must be disconnected first */
+void irc_tls_free(struct irc_tls *t);
+
+#endif
+#endif
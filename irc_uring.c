@@ -0,0 +1,367 @@
+#include "irc_uring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <ccan/array_size/array_size.h>
+#include <ccan/container_of/container_of.h>
+#include <ccan/err/err.h>
+#include <ccan/pr_debug/pr_debug.h>
+
+#include "irc.h"
+
+/* our only provided buffer group */
+#define URING_BGID 0
+
+/* in the low bits of user_data, a NULL user_data is a cancel */
+enum uring_op {
+	URING_RECV,
+	URING_SEND,
+};
+
+struct uring_conn {
+	/* NULL once detached */
+	struct irc_connection *c;
+	struct irc_uring *u;
+	int fd;
+
+	/* operations the kernel still has, we're freed when they're done */
+	unsigned inflight;
+	bool recv_armed;
+	bool sending;
+	bool waiting;
+	struct list_node wait_node;
+
+	/* for the send in flight */
+	struct msghdr msg;
+	struct iovec iov[16];
+	/* the output of a connection detached mid-send, which the kernel may
+	 * still be reading */
+	struct irc_outq held;
+};
+
+static struct io_uring_sqe *uring_sqe(struct irc_uring *u)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+	if (!sqe) {
+		/* full, make room */
+		io_uring_submit(&u->ring);
+		sqe = io_uring_get_sqe(&u->ring);
+	}
+	return sqe;
+}
+
+static void uring_conn_put(struct uring_conn *uc)
+{
+	if (uc->c || uc->inflight)
+		return;
+	irc_outq_free(&uc->held);
+	free(uc);
+}
+
+static int arm_recv(struct uring_conn *uc)
+{
+	struct io_uring_sqe *sqe = uring_sqe(uc->u);
+	if (!sqe)
+		return -1;
+
+	io_uring_prep_recv_multishot(sqe, uc->fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	io_uring_sqe_set_data(sqe, (char *)uc + URING_RECV);
+	uc->recv_armed = true;
+	uc->inflight++;
+	return 0;
+}
+
+static void send_queued(struct uring_conn *uc)
+{
+	struct irc_connection *c = uc->c;
+	size_t ct = irc_outq_iov(&c->out, uc->iov, ARRAY_SIZE(uc->iov));
+	if (!ct)
+		return;
+
+	struct io_uring_sqe *sqe = uring_sqe(uc->u);
+	if (!sqe) {
+		warnx("uring: no room to send, dropping %zu queued bytes",
+				c->out.len);
+		irc_outq_free(&c->out);
+		return;
+	}
+
+	uc->msg = (struct msghdr) {
+		.msg_iov = uc->iov,
+		.msg_iovlen = ct,
+	};
+	io_uring_prep_sendmsg(sqe, uc->fd, &uc->msg, MSG_NOSIGNAL);
+	io_uring_sqe_set_data(sqe, (char *)uc + URING_SEND);
+	uc->sending = true;
+	uc->inflight++;
+}
+
+static void recv_done(struct irc_uring *u, struct uring_conn *uc,
+		int res, unsigned flags)
+{
+	if (flags & IORING_CQE_F_BUFFER) {
+		unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		char *buf = u->bufs + (size_t)bid * IRC_URING_BUF_SIZE;
+
+		if (uc->c && res > 0 && irc_feed(uc->c, buf, res))
+			warnx("could not allocate input buffer");
+
+		/* the data has been copied or dispatched, hand it back */
+		io_uring_buf_ring_add(u->br, buf, IRC_URING_BUF_SIZE, bid,
+				io_uring_buf_ring_mask(IRC_URING_BUFS), 0);
+		io_uring_buf_ring_advance(u->br, 1);
+	}
+
+	/* the kernel is done with this recv */
+	if (!(flags & IORING_CQE_F_MORE)) {
+		uc->recv_armed = false;
+		uc->inflight--;
+	}
+
+	if (!uc->c) {
+		uring_conn_put(uc);
+		return;
+	}
+
+	if (res == 0 || (res < 0 && res != -ENOBUFS)) {
+		if (res < 0) {
+			errno = -res;
+			warn("failed to read");
+		}
+		/* detaches, which may free uc */
+		irc_io_closed(uc->c);
+		return;
+	}
+
+	/* out of buffers (or the kernel ended it), go again */
+	if (!uc->recv_armed && arm_recv(uc))
+		warnx("uring: could not re-arm recv on fd %d", uc->fd);
+}
+
+static void send_done(struct irc_uring *u, struct uring_conn *uc, int res)
+{
+	struct irc_connection *c = uc->c;
+	uc->sending = false;
+	uc->inflight--;
+
+	if (!c) {
+		uring_conn_put(uc);
+		return;
+	}
+
+	if (res >= 0) {
+		irc_outq_consume(&c->out, res);
+	} else {
+		errno = -res;
+		warn("failed to write, dropping %zu queued bytes", c->out.len);
+		irc_outq_free(&c->out);
+	}
+
+	if (c->out.len)
+		c->io->kick(c);
+}
+
+static void uring_cqe_cb(EV_P_ ev_io *w, int revents)
+{
+	struct irc_uring *u = container_of(w, typeof(*u), ew);
+	struct io_uring_cqe *cqe;
+	uint64_t ct;
+
+	if (read(u->efd, &ct, sizeof(ct)) < 0 && errno != EAGAIN)
+		warn("uring: could not read eventfd");
+
+	while (!io_uring_peek_cqe(&u->ring, &cqe)) {
+		uintptr_t data = cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+		io_uring_cqe_seen(&u->ring, cqe);
+
+		if (!data)
+			continue;
+
+		struct uring_conn *uc = (struct uring_conn *)(data & ~(uintptr_t)1);
+		if ((data & 1) == URING_SEND)
+			send_done(u, uc, res);
+		else
+			recv_done(u, uc, res, flags);
+	}
+}
+
+static void uring_submit_cb(EV_P_ ev_prepare *w, int revents)
+{
+	struct irc_uring *u = container_of(w, typeof(*u), submit);
+	struct uring_conn *uc, *next;
+
+	list_for_each_safe(&u->send_wait, uc, next, wait_node) {
+		list_del(&uc->wait_node);
+		uc->waiting = false;
+		send_queued(uc);
+	}
+
+	if (io_uring_sq_ready(&u->ring)) {
+		int r = io_uring_submit(&u->ring);
+		if (r < 0)
+			pr_debug(1, "uring: submit failed: %s", strerror(-r));
+	}
+}
+
+static int uring_attach(struct irc_connection *c)
+{
+	struct irc_uring *u = container_of(c->io, struct irc_uring, io);
+	struct uring_conn *uc = calloc(1, sizeof(*uc));
+	if (!uc) {
+		warnx("uring: could not attach fd %d", c->fd);
+		return -1;
+	}
+
+	uc->c = c;
+	uc->u = u;
+	uc->fd = c->fd;
+	irc_outq_init(&uc->held);
+	c->io_priv = uc;
+
+	if (!u->conns++)
+		ev_io_start(u->loop, &u->ew);
+	/* uc is cleaned up by the detach that follows */
+	if (arm_recv(uc)) {
+		warnx("uring: could not start receiving on fd %d", c->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void uring_detach(struct irc_connection *c)
+{
+	struct uring_conn *uc = c->io_priv;
+	if (!uc)
+		return;
+	struct irc_uring *u = uc->u;
+
+	c->io_priv = NULL;
+	uc->c = NULL;
+	if (uc->waiting)
+		list_del(&uc->wait_node);
+	if (uc->sending) {
+		uc->held = c->out;
+		irc_outq_init(&c->out);
+	}
+
+	/* must reach the kernel before the fd is closed */
+	if (uc->inflight) {
+		struct io_uring_sqe *sqe = uring_sqe(u);
+		if (sqe) {
+			io_uring_prep_cancel_fd(sqe, uc->fd, IORING_ASYNC_CANCEL_ALL);
+			io_uring_sqe_set_data(sqe, NULL);
+		}
+		io_uring_submit(&u->ring);
+	}
+
+	if (!--u->conns)
+		ev_io_stop(u->loop, &u->ew);
+	uring_conn_put(uc);
+}
+
+static void uring_kick(struct irc_connection *c)
+{
+	struct uring_conn *uc = c->io_priv;
+	if (!uc || uc->sending || uc->waiting)
+		return;
+	list_add_tail(&uc->u->send_wait, &uc->wait_node);
+	uc->waiting = true;
+}
+
+static bool uring_active(struct irc_connection *c)
+{
+	return c->io_priv;
+}
+
+int irc_uring_init(EV_P_ struct irc_uring *u)
+{
+	unsigned i;
+	int r;
+
+	*u = (struct irc_uring) {
+		.io = {
+			.name = "uring",
+			.attach = uring_attach,
+			.detach = uring_detach,
+			.kick = uring_kick,
+			.active = uring_active,
+		},
+		.loop = EV_A,
+		.efd = -1,
+	};
+	list_head_init(&u->send_wait);
+
+	r = io_uring_queue_init(IRC_URING_ENTRIES, &u->ring, 0);
+	if (r < 0) {
+		errno = -r;
+		warn("uring: could not set up a ring");
+		return -1;
+	}
+
+	u->bufs = malloc((size_t)IRC_URING_BUFS * IRC_URING_BUF_SIZE);
+	if (!u->bufs)
+		goto err_ring;
+
+	u->br = io_uring_setup_buf_ring(&u->ring, IRC_URING_BUFS, URING_BGID,
+			0, &r);
+	if (!u->br) {
+		errno = -r;
+		warn("uring: could not set up provided buffers");
+		goto err_bufs;
+	}
+	for (i = 0; i < IRC_URING_BUFS; i++)
+		io_uring_buf_ring_add(u->br, u->bufs + (size_t)i * IRC_URING_BUF_SIZE,
+				IRC_URING_BUF_SIZE, i,
+				io_uring_buf_ring_mask(IRC_URING_BUFS), i);
+	io_uring_buf_ring_advance(u->br, IRC_URING_BUFS);
+
+	u->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (u->efd < 0) {
+		warn("uring: could not create an eventfd");
+		goto err_br;
+	}
+	r = io_uring_register_eventfd(&u->ring, u->efd);
+	if (r < 0) {
+		errno = -r;
+		warn("uring: could not register the eventfd");
+		goto err_efd;
+	}
+
+	ev_io_init(&u->ew, uring_cqe_cb, u->efd, EV_READ);
+	ev_prepare_init(&u->submit, uring_submit_cb);
+	ev_prepare_start(EV_A_ &u->submit);
+	/* only attached connections keep the loop going */
+	ev_unref(EV_A);
+	return 0;
+
+err_efd:
+	close(u->efd);
+err_br:
+	io_uring_free_buf_ring(&u->ring, u->br, IRC_URING_BUFS, URING_BGID);
+err_bufs:
+	free(u->bufs);
+err_ring:
+	io_uring_queue_exit(&u->ring);
+	return -1;
+}
+
+void irc_uring_free(struct irc_uring *u)
+{
+	ev_ref(u->loop);
+	ev_prepare_stop(u->loop, &u->submit);
+	ev_io_stop(u->loop, &u->ew);
+
+	io_uring_free_buf_ring(&u->ring, u->br, IRC_URING_BUFS, URING_BGID);
+	io_uring_queue_exit(&u->ring);
+	close(u->efd);
+	free(u->bufs);
+}
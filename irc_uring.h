@@ -0,0 +1,60 @@
+#ifndef IRC_URING_H_
+#define IRC_URING_H_
+
+#ifdef WANT_URING
+
+#include <stdbool.h>
+#include <liburing.h>
+#include <ev.h>
+#include <ccan/list/list.h>
+
+#include "irc_io.h"
+
+/*
+ * An io_uring backend for struct irc_connection, shared by every connection
+ * on one loop.
+ *
+ * Each connection has a single multishot recv outstanding, picking buffers
+ * from a ring provided to the kernel, so incoming traffic needs no read()
+ * per message. Output kicked during a loop iteration is sent with one
+ * sendmsg per connection, and all of them (plus any recv re-arms) go to the
+ * kernel in a single io_uring_submit() before the loop blocks. Completions
+ * are signalled through an eventfd watched by the loop.
+ *
+ * Use it by setting c->io = &u->io before irc_init().
+ */
+
+#define IRC_URING_ENTRIES   256
+/* must be a power of 2 */
+#define IRC_URING_BUFS      64
+#define IRC_URING_BUF_SIZE  4096
+
+struct irc_uring {
+	/* what connections point at, leads back here */
+	struct irc_io_ops io;
+
+	struct ev_loop *loop;
+	struct io_uring ring;
+
+	/* completions are ready */
+	int efd;
+	ev_io ew;
+	/* everything prepared this iteration goes in one submit */
+	ev_prepare submit;
+
+	struct io_uring_buf_ring *br;
+	char *bufs;
+
+	/* connections with output to send and no send in flight */
+	struct list_head send_wait;
+	/* attached connections, ew is only active while there are some */
+	size_t conns;
+};
+
+/* return: 0, or -1 if io_uring (or one of the features used) is unavailable */
+int irc_uring_init(EV_P_ struct irc_uring *u);
+/* every connection using @u must be disconnected first */
+void irc_uring_free(struct irc_uring *u);
+
+#endif
+#endif
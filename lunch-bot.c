@@ -1,6 +1,7 @@
 #include "irc.h"
 #include "irc_helpers.h"
 #include "user-track.h"
+#include "irc_tls.h"
 
 #include <ccan/pr_debug/pr_debug.h>
 #include <ccan/compiler/compiler.h>
@@ -14,8 +15,13 @@
 #include <penny/mem.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <limits.h>
+#include <sys/mman.h>
 
 struct msg_source {
 	enum {
@@ -37,6 +43,10 @@ struct irc_ctx {
 	struct irc_connection c;
 	struct irc_usertrack_channel ut;
 	const char *prgm;
+	/* <user> <channel> <server> <port>, passed on when we re-exec */
+	char **args;
+	/* re-execs once every line read has been handled */
+	ev_prepare exec_prepare;
 };
 
 static struct irc_ctx *con_to_ctx(struct irc_connection *c)
@@ -174,50 +184,178 @@ static int cmd_ring(struct irc_connection *c, const struct msg_source *src,
 	struct irc_user *u;
 	tommy_node *node;
 	unsigned i, j;
-	char buf[IRC_MAX_LINE_LENGTH];
-	unsigned used = 0;
 
 	if (!ut->users.count)
 		return 0;
 
-	used += snprintf(buf, ARRAY_SIZE(buf), "PRIVMSG %.*s :", (int)ut->channel_len, ut->channel);
-	irc_usertrack_channel_for_each_user(ut, u, node, i, j) {
-		used += snprintf(buf + used, SUB_SAT(ARRAY_SIZE(buf), used),
-				"%.*s ", (int)u->nick_len, u->nick);
-	}
-
 	if (msg_len == 0) {
 		msg = "RING";
 		msg_len = strlen(msg);
 	}
 
-	used += snprintf(buf + used, SUB_SAT(ARRAY_SIZE(buf), used),
-			": %.*s", (int)msg_len, msg);
+	size_t len = 2 + msg_len;
+	irc_usertrack_channel_for_each_user(ut, u, node, i, j)
+		len += u->nick_len + 1;
 
-	unsigned rem = SUB_SAT(ARRAY_SIZE(buf), used);
-	/* grab 2 spaces for termination */
-	while (rem < 2) {
-		rem++;
-		used--;
-	}
+	char *buf = malloc(len);
+	if (!buf)
+		return -1;
 
-	buf[used] = '\r';
-	buf[used + 1] = '\n';
-	used += 2;
+	/* irc_cmd_privmsg() splits this over as many lines as it takes */
+	size_t used = 0;
+	irc_usertrack_channel_for_each_user(ut, u, node, i, j) {
+		memcpy(buf + used, u->nick, u->nick_len);
+		used += u->nick_len;
+		buf[used++] = ' ';
+	}
+	buf[used++] = ':';
+	buf[used++] = ' ';
+	memcpy(buf + used, msg, msg_len);
+	used += msg_len;
 
-	return irc_cmd(c, buf, MIN(used, ARRAY_SIZE(buf)));
+	int r = irc_cmd_privmsg(c, ut->channel, ut->channel_len, buf, used);
+	free(buf);
+	return r;
 }
 
 static int cmd_exec(struct irc_connection *c, const struct msg_source *src,
 		const char *cmd, size_t cmd_len, const char *msg, size_t msg_len)
 {
-	const char *prgm = con_to_ctx(c)->prgm;
-	char buf[16];
-	sprintf(buf, "%u", c->w.fd);
-	execlp(prgm, "-f", c->w.fd, c->server, c->port, NULL);
+	if (!irc_dump_state(c, NULL, 0)) {
+		msg_reply_fmt(c, src, "this connection can't be carried over an exec");
+		return 0;
+	}
+
+	/* the state is taken from outside of any handler, see irc_dump_state() */
+	ev_prepare_start(c->loop, &con_to_ctx(c)->exec_prepare);
+	msg_reply_fmt(c, src, "re-executing %s", con_to_ctx(c)->prgm);
 	return 0;
 }
 
+/* return: a memfd holding @data, that survives an exec, or -1 */
+static int exec_fd(const char *name, const char *data, size_t len)
+{
+	int fd = memfd_create(name, 0);
+	if (fd == -1)
+		return -1;
+	while (len) {
+		ssize_t r = write(fd, data, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			return -1;
+		}
+		data += r;
+		len -= r;
+	}
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Read all of the fd named by @arg (as exec_fd() passed it) and close it.
+ * return: the contents, to be free()d, or NULL.
+ */
+static char *exec_fd_read(const char *arg, size_t *len)
+{
+	char *end;
+	errno = 0;
+	long fd = strtol(arg, &end, 10);
+	if (errno || end == arg || *end || fd < 0 || fd > INT_MAX) {
+		warnx("not an fd: %s", arg);
+		return NULL;
+	}
+
+	size_t cap = 4096, l = 0;
+	char *buf = malloc(cap);
+	for (;;) {
+		if (!buf)
+			break;
+		ssize_t r = read(fd, buf + l, cap - l);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			warn("could not read fd %ld", fd);
+			free(buf);
+			buf = NULL;
+			break;
+		}
+		if (!r)
+			break;
+		l += r;
+		if (l == cap) {
+			char *n = realloc(buf, cap * 2);
+			if (!n)
+				free(buf);
+			buf = n;
+			cap *= 2;
+		}
+	}
+
+	close(fd);
+	*len = l;
+	return buf;
+}
+
+static void exec_prepare_cb(EV_P_ ev_prepare *w, int revents)
+{
+	struct irc_ctx *ctx = container_of(w, struct irc_ctx, exec_prepare);
+	struct irc_connection *c = &ctx->c;
+	ev_prepare_stop(EV_A_ w);
+
+	size_t state_len = irc_dump_state(c, NULL, 0);
+	size_t users_len = irc_ut_channel_dump(&ctx->ut, NULL, 0);
+	char *state = malloc(state_len + 1);
+	char *users = malloc(users_len + 1);
+	int state_fd = -1, users_fd = -1;
+	if (!state_len || !state || !users) {
+		msg_owner(c, "exec: could not save state\n");
+		goto out;
+	}
+	irc_dump_state(c, state, state_len + 1);
+	irc_ut_channel_dump(&ctx->ut, users, users_len + 1);
+
+	/* not on the command line: it holds any queued PASS or IDENTIFY, and
+	 * can be longer than an argument may be */
+	state_fd = exec_fd("lunch-bot-state", state, state_len);
+	users_fd = exec_fd("lunch-bot-users", users, users_len);
+	if (state_fd == -1 || users_fd == -1) {
+		msg_owner(c, "exec: could not save state: %s\n", strerror(errno));
+		goto out;
+	}
+	char state_arg[12], users_arg[12];
+	snprintf(state_arg, sizeof(state_arg), "%d", state_fd);
+	snprintf(users_arg, sizeof(users_arg), "%d", users_fd);
+
+	/* the connector makes sockets close-on-exec */
+	int fl = fcntl(c->fd, F_GETFD);
+	if (fl == -1 || fcntl(c->fd, F_SETFD, fl & ~FD_CLOEXEC) == -1) {
+		msg_owner(c, "exec: could not keep fd %d open: %s\n", c->fd,
+				strerror(errno));
+		goto out;
+	}
+
+	fflush(stdout);
+	execlp(ctx->prgm, ctx->prgm, "-s", state_arg, "-u", users_arg,
+			ctx->args[0], ctx->args[1], ctx->args[2], ctx->args[3],
+			NULL);
+
+	int e = errno;
+	fcntl(c->fd, F_SETFD, fl);
+	msg_owner(c, "exec: could not run %s: %s\n", ctx->prgm, strerror(e));
+out:
+	if (state_fd != -1)
+		close(state_fd);
+	if (users_fd != -1)
+		close(users_fd);
+	free(state);
+	free(users);
+}
+
 static struct command commands [] = {
 	CMD(unknown), /* this is triggered when the command isn't recognized */
 	CMD(help),
@@ -261,12 +399,11 @@ static void run_command(struct irc_connection *c, struct msg_source *src,
  *
  */
 static int do_privmsg(struct irc_connection *c, struct irc_operation *op,
-		char const *src, size_t src_len,
+		const struct irc_message *m,
 		struct arg *dests, size_t dest_ct,
 		char const *msg, size_t msg_len)
 {
-	const char *name_end = memchr(src, '!', src_len);
-	printf("PRIV: %.*s %.*s (ct=%d) %.*s\n", (int)src_len, src,
+	printf("PRIV: %.*s %.*s (ct=%d) %.*s\n", (int)m->prefix.len, m->prefix.data,
 			(int) dests[0].len, dests[0].data,
 			(int)dest_ct, (int)msg_len, msg);
 
@@ -279,9 +416,13 @@ static int do_privmsg(struct irc_connection *c, struct irc_operation *op,
 		return 0;
 	}
 
+	/* there is no one to reply to */
+	if (m->from_server)
+		return 0;
+
 	struct msg_source msg_src = {
-		.user = src,
-		.user_len = name_end - src,
+		.user = m->nick.data,
+		.user_len = m->nick.len,
 	};
 
 	if (*dests[0].data == '#') {
@@ -314,21 +455,17 @@ static int do_privmsg(struct irc_connection *c, struct irc_operation *op,
 }
 
 static int on_privmsg(struct irc_connection *c, struct irc_operation *op,
-		char const *prefix, size_t prefix_len,
-		char const *remain, size_t remain_len)
+		const struct irc_message *m)
 {
-	return privmsg_helper(c, op, prefix, prefix_len, remain,
-			remain_len, do_privmsg);
+	return privmsg_helper(c, op, m, do_privmsg);
 }
 
 static int on_kick(struct irc_connection *c, struct irc_operation *op,
-		char const *prefix, size_t prefix_len,
-		char const *remain, size_t remain_len)
+		const struct irc_message *m)
 {
-	struct arg args[3];
-	int r = irc_parse_args(remain, remain_len, args, ARRAY_SIZE(args));
-	if (r != ARRAY_SIZE(args)) {
-		pr_debug(-1, "KICK: could not parse args: %d", r);
+	const struct arg *args = m->params;
+	if (m->param_ct != 3) {
+		pr_debug(-1, "KICK: could not parse args: %zu", m->param_ct);
 		return -1;
 	}
 
@@ -348,35 +485,73 @@ static int on_kick(struct irc_connection *c, struct irc_operation *op,
 }
 
 static int on_connect(struct irc_connection *c, struct irc_operation *op,
-		char const *prefix, size_t prefix_len,
-		char const *remain, size_t remain_len)
+		const struct irc_message *m)
 {
-	irc_cmd_join_(c, con_to_ctx(c)->ut.channel);
+	/* after a reconnect it is rejoined with the rest of our channels */
+	struct irc_usertrack_channel *ut = &con_to_ctx(c)->ut;
+	if (!irc_in_channel(c, ut->channel, ut->channel_len))
+		irc_cmd_join(c, ut->channel, ut->channel_len);
 	return 0;
 }
 
 int main(int argc, char **argv)
 {
 	err_set_progname(argv[0]);
-	if (argc != 5) {
-		fprintf(stderr, "usage: %s <user> <channel> <server> <port>\n", argv[0]);
+
+	const char *state = NULL, *users = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:u:")) != -1) {
+		switch (opt) {
+		case 's':
+			state = optarg;
+			break;
+		case 'u':
+			users = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 4) {
+usage:
+		fprintf(stderr, "usage: %s [-s <state fd> [-u <users fd>]] <user> <channel> <server> <port>\n"
+				"  a port of \"+6697\" connects to 6697 with TLS\n"
+				"  -s & -u carry on a connection from the state read from those\n"
+				"  fds, as the \"exec\" command does\n",
+				argv[0]);
 		return -1;
 	}
 
-	const char *channel = argv[2];
+	char **args = argv + optind;
+	const char *channel = args[1];
 
 	struct irc_ctx c = {
 		.c = {
-			.server = argv[3],
-			.port   = argv[4],
+			.server = args[2],
+			.port   = args[3],
+
+			SLM(nick, args[0]),
 
-			SLM(nick, argv[1]),
+			.user = args[0],
+			.realname = args[0],
 
-			.user = argv[1],
-			.realname = argv[1],
+			.reconnect = true,
 		},
 		.prgm = argv[0],
+		.args = args,
 	};
+	ev_prepare_init(&c.exec_prepare, exec_prepare_cb);
+
+#ifndef NO_TLS
+	struct irc_tls tls;
+	if (*c.c.port == '+') {
+		if (irc_tls_init(&tls))
+			return -1;
+		c.c.io = &tls.io;
+		c.c.port++;
+	}
+#endif
 
 	irc_init(&c.c);
 
@@ -394,7 +569,25 @@ int main(int argc, char **argv)
 
 	irc_add_ping_handler(&c.c);
 
-	irc_connect(&c.c);
+	if (!state) {
+		irc_connect(&c.c);
+	} else {
+		size_t len;
+		char *buf;
+		if (users) {
+			buf = exec_fd_read(users, &len);
+			if (!buf || irc_ut_channel_load(&c.ut, buf, len))
+				warnx("could not load users, they will be relearned on the next NAMES");
+			free(buf);
+		}
+
+		buf = exec_fd_read(state, &len);
+		if (!buf || irc_load_state(&c.c, buf, len)) {
+			irc_disconnect(&c.c);
+			irc_connect(&c.c);
+		}
+		free(buf);
+	}
 
 	ev_run(EV_DEFAULT_ 0);
 	return 0;
@@ -0,0 +1,208 @@
+#include "parse-c-struct-izl.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+static size_t skip_space(const char *s, size_t len)
+{
+	size_t p = 0;
+	while (p < len && isspace((unsigned char)s[p]))
+		p++;
+	return p;
+}
+
+static int hex_val(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * What follows a '\'. Unlike C, "\x" takes at most 2 hex digits, so "\x0ab"
+ * is "\n" "b" rather than too large.
+ */
+static ssize_t parse_escape(const char *s, size_t len, char *ch)
+{
+	if (!len)
+		return -1;
+
+	switch (*s) {
+	case 'a': *ch = '\a'; return 1;
+	case 'b': *ch = '\b'; return 1;
+	case 'f': *ch = '\f'; return 1;
+	case 'n': *ch = '\n'; return 1;
+	case 'r': *ch = '\r'; return 1;
+	case 't': *ch = '\t'; return 1;
+	case 'v': *ch = '\v'; return 1;
+	case '\\':
+	case '"':
+	case '\'':
+	case '?':
+		*ch = *s;
+		return 1;
+	case 'x': {
+		size_t p = 1;
+		unsigned v = 0;
+		while (p < len && p < 3 && hex_val(s[p]) >= 0)
+			v = v * 16 + hex_val(s[p++]);
+		if (p == 1)
+			return -1;
+		*ch = v;
+		return p;
+	}
+	}
+
+	size_t p = 0;
+	unsigned v = 0;
+	while (p < len && p < 3 && s[p] >= '0' && s[p] <= '7')
+		v = v * 8 + (s[p++] - '0');
+	if (!p || v > 0xff)
+		return -1;
+	*ch = v;
+	return p;
+}
+
+ssize_t parse_str(const char *s, size_t len, char *out, size_t *out_len)
+{
+	size_t p = 0, o = 0;
+	bool any = false;
+
+	for (;;) {
+		size_t q = p;
+		if (any)
+			q += skip_space(s + q, len - q);
+		if (q >= len || s[q] != '"') {
+			if (!any)
+				return -1;
+			break;
+		}
+		q++;
+
+		for (;;) {
+			if (q >= len)
+				return -1;
+			char ch = s[q++];
+			if (ch == '"')
+				break;
+			if (ch == '\n')
+				return -1;
+			if (ch == '\\') {
+				ssize_t r = parse_escape(s + q, len - q, &ch);
+				if (r < 0)
+					return -1;
+				q += r;
+			}
+			if (o >= *out_len)
+				return -1;
+			out[o++] = ch;
+		}
+
+		p = q;
+		any = true;
+	}
+
+	*out_len = o;
+	return p;
+}
+
+ssize_t parse_uint(const char *s, size_t len, uintmax_t *v)
+{
+	size_t p = 0;
+	uintmax_t n = 0;
+	while (p < len && s[p] >= '0' && s[p] <= '9') {
+		unsigned d = s[p] - '0';
+		if (n > (UINTMAX_MAX - d) / 10)
+			return -1;
+		n = n * 10 + d;
+		p++;
+	}
+
+	if (!p)
+		return -1;
+	*v = n;
+	return p;
+}
+
+ssize_t parse_id(const char *s, size_t len, const char **id)
+{
+	size_t p = 0;
+	if (!len || !(isalpha((unsigned char)*s) || *s == '_'))
+		return 0;
+	while (p < len && (isalnum((unsigned char)s[p]) || s[p] == '_'))
+		p++;
+	*id = s;
+	return p;
+}
+
+ssize_t parse_elem(struct c_ilz_ctx *i, const char *s, size_t len)
+{
+	if (!len || *s != '.')
+		return -1;
+
+	const char *id;
+	ssize_t id_len = parse_id(s + 1, len - 1, &id);
+	if (id_len <= 0)
+		return -1;
+
+	size_t p = 1 + id_len;
+	if (p >= len || s[p] != '=')
+		return -1;
+	p++;
+
+	if (p < len && s[p] == '"') {
+		if (!i->parse_string)
+			return -1;
+
+		/* unescaping never makes it longer */
+		size_t str_len = len - p;
+		char *str = malloc(str_len);
+		if (!str)
+			return -1;
+
+		ssize_t r = parse_str(s + p, len - p, str, &str_len);
+		int e = r < 0 ? -1 : i->parse_string(i, id, id_len, str, str_len);
+		free(str);
+		if (e)
+			return -1;
+		return p + r;
+	}
+
+	uintmax_t v;
+	ssize_t r = parse_uint(s + p, len - p, &v);
+	if (r < 0 || !i->parse_uint || i->parse_uint(i, id, id_len, v))
+		return -1;
+	return p + r;
+}
+
+ssize_t parse_struct(struct c_ilz_ctx *i, const char *s, size_t len)
+{
+	size_t p = skip_space(s, len);
+	if (p >= len || s[p] != '{')
+		return -1;
+	p++;
+
+	for (;;) {
+		p += skip_space(s + p, len - p);
+		if (p < len && s[p] == '}')
+			return p + 1;
+
+		ssize_t r = parse_elem(i, s + p, len - p);
+		if (r < 0)
+			return -1;
+		p += r;
+
+		p += skip_space(s + p, len - p);
+		if (p < len && s[p] == ',')
+			p++;
+		else if (p < len && s[p] == '}')
+			return p + 1;
+		else
+			return -1;
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef PARSE_C_STRUCT_IZL_H_
+#define PARSE_C_STRUCT_IZL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Parsing of C designated initializer lists, the format irc_dump_state()
+ * writes:
+ *
+ *   {.fd=3,.server="irc.example.net",.buffer="PING :ab" "c\r\n"}
+ *
+ * Only unsigned integers and strings (adjacent literals are joined, as in C)
+ * are understood. Each element is handed to a callback as it is parsed, so a
+ * designator may appear more than once.
+ *
+ * Every parse_*() returns the number of bytes of @s consumed, or -1 if it
+ * doesn't start with what was asked for.
+ */
+
+struct c_ilz_ctx {
+	/* return: 0 to continue, anything else stops the parse with an error */
+	int (*parse_uint)(struct c_ilz_ctx *i, const char *id, size_t id_len,
+			uintmax_t v);
+	/* @str is only valid during the call, and may contain '\0's */
+	int (*parse_string)(struct c_ilz_ctx *i, const char *id, size_t id_len,
+			const char *str, size_t str_len);
+};
+
+/* "{" elem ("," elem)* [","] "}" */
+ssize_t parse_struct(struct c_ilz_ctx *i, const char *s, size_t len);
+/* "." id "=" (uint | string) */
+ssize_t parse_elem(struct c_ilz_ctx *i, const char *s, size_t len);
+
+/* @id is pointed into @s. return: 0 if @s doesn't start with an identifier */
+ssize_t parse_id(const char *s, size_t len, const char **id);
+/* decimal only, -1 on overflow */
+ssize_t parse_uint(const char *s, size_t len, uintmax_t *v);
+/*
+ * One or more adjacent string literals, unescaped into @out. *@out_len is its
+ * size going in and the length of the string coming out.
+ */
+ssize_t parse_str(const char *s, size_t len, char *out, size_t *out_len);
+
+#endif
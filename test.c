@@ -11,34 +11,32 @@
 #include <stdio.h>
 
 static int do_privmsg(struct irc_connection *c, struct irc_operation *op,
-		char const *src, size_t src_len,
+		const struct irc_message *m,
 		struct arg *dests, size_t dest_ct,
 		char const *msg, size_t msg_len)
 {
-	const char *name_end = memchr(src, '!', src_len);
+	if (m->from_server)
+		return 0;
+
 	if (memeqstr(msg, msg_len, ",hi")) {
 		irc_cmd_privmsg_fmt(c, dests[0].data, dests[0].len,
-				"HI, %.*s", (int)(name_end - src), src);
+				"HI, %.*s", (int)m->nick.len, m->nick.data);
 	}
 	return 0;
 }
 
 static int on_privmsg(struct irc_connection *c, struct irc_operation *op,
-		char const *prefix, size_t prefix_len,
-		char const *remain, size_t remain_len)
+		const struct irc_message *m)
 {
-	return privmsg_helper(c, op, prefix, prefix_len, remain,
-			remain_len, do_privmsg);
+	return privmsg_helper(c, op, m, do_privmsg);
 }
 
 static int on_kick(struct irc_connection *c, struct irc_operation *op,
-		char const *prefix, size_t prefix_len,
-		char const *remain, size_t remain_len)
+		const struct irc_message *m)
 {
-	struct arg args[3];
-	int r = irc_parse_args(remain, remain_len, args, ARRAY_SIZE(args));
-	if (r != ARRAY_SIZE(args)) {
-		pr_debug(-1, "KICK: could not parse args: %d", r);
+	const struct arg *args = m->params;
+	if (m->param_ct != 3) {
+		pr_debug(-1, "KICK: could not parse args: %zu", m->param_ct);
 		return -1;
 	}
 
@@ -60,8 +58,7 @@ static int on_kick(struct irc_connection *c, struct irc_operation *op,
 }
 
 static int on_connect(struct irc_connection *c, struct irc_operation *op,
-		const char *prefix, size_t prefix_len,
-		const char *remain, size_t remain_len)
+		const struct irc_message *m)
 {
 	irc_cmd_join_(c, "#botwar");
 	return 0;
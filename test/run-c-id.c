@@ -15,7 +15,7 @@
 int main(void)
 {
 	ssize_t p;
-	char *out;
+	const char *out;
 	size_t err_ct = 0;
 
 #define P(s) parse_id(s, strlen(s), &out)
@@ -27,7 +27,8 @@ int main(void)
 	print_bytes_as_cstring(b, b_len, stdout);		\
 	bool __MEM_EQ = memeq(a, a_len, b, b_len);	\
 	printf(": %s\n", __MEM_EQ ? "yes" : "NO!!!");	\
-	err_ct++;					\
+	if (!__MEM_EQ)					\
+		err_ct++;				\
 } while (0)
 
 #define ARRAY_EQ_MEM(a, b, b_len) do {		\
@@ -35,9 +35,10 @@ static int cb_str(struct c_ilz_ctx *i, const char *id_, size_t id_len_, const ch
 {
 	id = id_;
 	id_len = id_len_;
-	memcpy(str, str_, sizeof(str));
+	memcpy(str, str_, str_len_);
 	str_len = str_len_;
 	type = TYPE_STR;
+	return 0;
 }
 
 int main(void)
@@ -58,7 +59,8 @@ int main(void)
 	print_bytes_as_cstring(b, b_len, stdout);		\
 	bool __MEM_EQ = memeq(a, a_len, b, b_len);	\
 	printf(": %s\n", __MEM_EQ ? "yes" : "NO!!!");	\
-	err_ct++;					\
+	if (!__MEM_EQ)					\
+		err_ct++;				\
 } while (0)
 
 #define STRLIT_EQ_MEM(a, b, b_len) do {		\
@@ -108,6 +110,13 @@ int main(void)
 	C__(".bar=.3");
 #endif
 
+#undef P
+#define P(s) parse_struct(&ctx, s, strlen(s))
+
+	C_S("{.foo=3,.bar=\"str\"}", "bar", "str");
+	C_I("{ .bar=\"a\" \"b\", .foo=11241, }", "foo", 11241);
+	C_S("{.foo=1,.bar=\"\\x0ab\\r\\n\"}", "bar", "\nb\r\n");
+
 	return err_ct;
 }
 
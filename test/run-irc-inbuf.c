@@ -0,0 +1,123 @@
+#include "irc_inbuf.c"
+#include "irc_scan.c"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "penny/print.h"
+#include "penny/mem.h"
+
+struct expect {
+	const char *lines[64];
+	size_t pos;
+	size_t err_ct;
+};
+
+static void check_line(void *ctx, char *line, size_t len)
+{
+	struct expect *e = ctx;
+	const char *want = e->lines[e->pos++];
+	bool ok = want && memeq(line, len, want, strlen(want));
+	printf(">> ");
+	print_bytes_as_cstring(line, len, stdout);
+	printf(": %s\n", ok ? "yes" : "NO!!!");
+	if (!ok)
+		e->err_ct++;
+}
+
+/* feed @s into @in @chunk bytes at a time, as a series of reads would */
+static void feed(struct irc_inbuf *in, size_t max, const char *s, size_t chunk,
+		struct expect *e)
+{
+	size_t len = strlen(s);
+	while (len) {
+		struct iovec iov[2];
+		int i, ct = irc_inbuf_prepare(in, max, iov);
+		size_t n = 0;
+		for (i = 0; i < ct && len; i++) {
+			size_t l = iov[i].iov_len;
+			if (l > len)
+				l = len;
+			if (l > chunk - n)
+				l = chunk - n;
+			memcpy(iov[i].iov_base, s, l);
+			s += l;
+			len -= l;
+			n += l;
+		}
+		irc_inbuf_commit(in, n);
+		irc_inbuf_lines(in, SIZE_MAX, check_line, e);
+	}
+}
+
+int main(void)
+{
+	size_t err_ct = 0;
+	size_t chunk;
+	struct irc_inbuf in;
+
+#define E(...) (struct expect){ .lines = { __VA_ARGS__ } }
+
+	/* wrapped lines, bare LF, empty lines, at many read sizes */
+	for (chunk = 1; chunk < 300; chunk += 7) {
+		char line[900];
+		memset(line, 'a', sizeof(line) - 1);
+		line[sizeof(line) - 1] = '\0';
+
+		struct expect e = E("PING :a", "PING :b", line, "x", line, "y");
+		char all[4096];
+		snprintf(all, sizeof(all), "PING :a\r\nPING :b\n\r\n%s\r\nx\n%s\ny\r\n",
+				line, line);
+
+		irc_inbuf_init(&in);
+		feed(&in, 1024, all, chunk, &e);
+		if (e.pos != 6 || in.len) {
+			printf("chunk %zu: got %zu lines, %zu left: NO!!!\n",
+					chunk, e.pos, in.len);
+			err_ct++;
+		}
+		err_ct += e.err_ct;
+		irc_inbuf_free(&in);
+	}
+
+	/* growth for a long line, then discarding past the limit */
+	{
+		char line[5000];
+		memset(line, 'b', sizeof(line) - 1);
+		line[sizeof(line) - 1] = '\0';
+
+		char all[16384];
+		snprintf(all, sizeof(all), "%s\r\nok\r\n%s%s\r\nstill ok\r\n",
+				line, line, line);
+
+		struct expect e = E(line, "ok", "still ok");
+		irc_inbuf_init(&in);
+		feed(&in, 8192, all, 1000, &e);
+		if (e.pos != 3) {
+			printf("long lines: got %zu lines: NO!!!\n", e.pos);
+			err_ct++;
+		}
+		err_ct += e.err_ct;
+		irc_inbuf_free(&in);
+	}
+
+	/* lines held back by the limit are handed out later */
+	{
+		struct expect e = E("a", "b", "c");
+		irc_inbuf_init(&in);
+		struct iovec iov[2];
+		irc_inbuf_prepare(&in, 1024, iov);
+		memcpy(iov[0].iov_base, "a\nb\nc\n", 6);
+		irc_inbuf_commit(&in, 6);
+		size_t n = irc_inbuf_lines(&in, 2, check_line, &e);
+		n += irc_inbuf_lines(&in, 2, check_line, &e);
+		if (n != 3 || in.len) {
+			printf("limited: got %zu lines: NO!!!\n", n);
+			err_ct++;
+		}
+		err_ct += e.err_ct;
+		irc_inbuf_free(&in);
+	}
+
+	return err_ct;
+}
@@ -0,0 +1,55 @@
+#include "irc_lag.c"
+
+#include <stdio.h>
+#include <stdbool.h>
+
+int main(void)
+{
+	size_t err_ct = 0;
+	struct irc_lag_hist h;
+	unsigned i;
+
+	/* every bucket's range starts right after the previous one's */
+	for (i = 1; i < IRC_LAG_BUCKETS; i++) {
+		uint32_t lo = bucket_top(i - 1) + 1;
+		if (bucket_of(lo) != i || bucket_of(bucket_top(i)) != i) {
+			printf("bucket %u: [%u, %u] maps to %u, %u\n", i, lo,
+					bucket_top(i), bucket_of(lo),
+					bucket_of(bucket_top(i)));
+			err_ct++;
+		}
+	}
+	if (bucket_of(UINT32_MAX) != IRC_LAG_BUCKETS - 1) {
+		printf("UINT32_MAX is in bucket %u\n", bucket_of(UINT32_MAX));
+		err_ct++;
+	}
+
+#define Q(q, lo, hi) do {						\
+	double __v = irc_lag_hist_quantile(&h, q);			\
+	bool __ok = __v >= (lo) && __v <= (hi);				\
+	printf("Q(%g) = %.6f: %s\n", (double)(q), __v, __ok ? "yes" : "NO!!!"); \
+	if (!__ok)							\
+		err_ct++;						\
+} while (0)
+
+	irc_lag_hist_reset(&h);
+	Q(0.5, 0, 0);
+
+	/* 1ms .. 100ms */
+	for (i = 1; i <= 100; i++)
+		irc_lag_hist_add(&h, i / 1000.);
+	Q(0, 0.001, 0.001);
+	Q(0.5, 0.050, 0.050 * (1 + 1. / IRC_LAG_SUB));
+	Q(0.99, 0.099, 0.099 * (1 + 1. / IRC_LAG_SUB));
+	Q(1, 0.100, 0.100);
+
+	/* clamped, not lost */
+	irc_lag_hist_add(&h, 1e6);
+	Q(1, 1e6, 1e6);
+	if (h.samples != 101) {
+		printf("samples = %llu\n", h.samples);
+		err_ct++;
+	}
+
+	return err_ct;
+}
@@ -0,0 +1,85 @@
+#include "irc_mpsc.c"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ccan/container_of/container_of.h>
+
+#define PRODUCERS 8
+#define PER_PRODUCER 100000
+
+struct item {
+	struct irc_mpsc_node node;
+	unsigned producer, seq;
+};
+
+static struct irc_mpsc q;
+static struct item items[PRODUCERS][PER_PRODUCER];
+
+static void *producer(void *arg)
+{
+	unsigned p = (unsigned)(uintptr_t)arg, i;
+	for (i = 0; i < PER_PRODUCER; i++) {
+		items[p][i] = (struct item) { .producer = p, .seq = i };
+		irc_mpsc_push(&q, &items[p][i].node);
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	size_t err_ct = 0;
+	pthread_t t[PRODUCERS];
+	unsigned next[PRODUCERS] = { 0 };
+	size_t got = 0, i;
+
+	irc_mpsc_init(&q);
+	if (irc_mpsc_pop(&q)) {
+		printf("pop from an empty queue returned something\n");
+		err_ct++;
+	}
+
+	for (i = 0; i < PRODUCERS; i++)
+		if (pthread_create(&t[i], NULL, producer, (void *)(uintptr_t)i)) {
+			perror("pthread_create");
+			return 1;
+		}
+
+	/* pop while they push: everything arrives once, and each producer's
+	 * items in the order it pushed them */
+	while (got < PRODUCERS * PER_PRODUCER) {
+		struct irc_mpsc_node *n = irc_mpsc_pop(&q);
+		if (!n) {
+			sched_yield();
+			continue;
+		}
+		struct item *it = container_of(n, struct item, node);
+		if (it->producer >= PRODUCERS || it->seq != next[it->producer]) {
+			printf("item %u/%u out of order\n", it->producer, it->seq);
+			err_ct++;
+			if (it->producer < PRODUCERS)
+				next[it->producer] = it->seq;
+		}
+		if (it->producer < PRODUCERS)
+			next[it->producer]++;
+		got++;
+	}
+
+	for (i = 0; i < PRODUCERS; i++) {
+		pthread_join(t[i], NULL);
+		if (next[i] != PER_PRODUCER) {
+			printf("producer %zu: %u of %u\n", i, next[i], PER_PRODUCER);
+			err_ct++;
+		}
+	}
+
+	if (irc_mpsc_pop(&q)) {
+		printf("pop after draining returned something\n");
+		err_ct++;
+	}
+
+	printf("%zu items, %zu errors\n", got, err_ct);
+	return err_ct;
+}
@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include "irc_outq.c"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "penny/mem.h"
+
+#define CHECK(cond) do {						\
+	bool __ok = (cond);						\
+	printf("%s: %s\n", #cond, __ok ? "yes" : "NO!!!");		\
+	if (!__ok)							\
+		err_ct++;						\
+} while (0)
+
+/* the queued bytes, in order, as irc_outq_iov() sees them */
+static size_t queued(struct irc_outq *q, char *out)
+{
+	struct iovec iov[64];
+	size_t i, len = 0, ct = irc_outq_iov(q, iov, 64);
+	for (i = 0; i < ct; i++) {
+		memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	return len;
+}
+
+/* @len bytes of line @n, each distinct so misordering shows */
+static void fill(char *p, size_t len, unsigned n)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+		p[i] = 'a' + (n + i) % 26;
+}
+
+int main(void)
+{
+	size_t err_ct = 0;
+	struct irc_outq q;
+	static char want[64 * IRC_OUTQ_BLOCK], got[64 * IRC_OUTQ_BLOCK];
+	size_t want_len = 0;
+	unsigned i;
+
+	irc_outq_init(&q);
+	CHECK(!irc_outq_reserve(&q, IRC_OUTQ_BLOCK + 1));
+	CHECK(!irc_outq_peek(&q, &(size_t){0}));
+
+	/* lengths that don't divide the block, so records straddle where a
+	 * block would end and have to start the next one */
+	for (i = 0; i < 100; i++) {
+		size_t len = 300 + i * 7;
+		char *p = irc_outq_reserve(&q, len);
+		if (!p) {
+			err_ct++;
+			break;
+		}
+		fill(p, len, i);
+		irc_outq_commit(&q, len);
+		fill(want + want_len, len, i);
+		want_len += len;
+	}
+	CHECK(q.len == want_len);
+	CHECK(q.first != q.last);
+	CHECK(queued(&q, got) == want_len && memeq(got, want_len, want, want_len));
+
+	/* a reserve that isn't committed isn't queued */
+	CHECK(irc_outq_reserve(&q, 10) != NULL);
+	CHECK(q.len == want_len);
+
+	/* consume part of a block, then up to and across block boundaries */
+	size_t steps[] = { 1, 299, IRC_OUTQ_BLOCK - 300, IRC_OUTQ_BLOCK + 17, 5000 };
+	size_t off = 0;
+	for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+		irc_outq_consume(&q, steps[i]);
+		off += steps[i];
+		size_t l = queued(&q, got);
+		CHECK(l == want_len - off
+				&& memeq(got, l, want + off, want_len - off));
+
+		size_t pl;
+		char *p = irc_outq_peek(&q, &pl);
+		CHECK(p && pl && memeq(p, pl, want + off, pl));
+	}
+
+	/* short writes: a pipe holds less than is queued */
+	int fds[2];
+	if (pipe2(fds, O_NONBLOCK) || fcntl(fds[1], F_SETPIPE_SZ, 4096) < 0) {
+		perror("pipe");
+		return 1;
+	}
+	size_t read_len = 0, flushes = 0;
+	while (q.len) {
+		ssize_t r = irc_outq_flush(&q, fds[1]);
+		if (r < 0 && errno != EAGAIN) {
+			perror("irc_outq_flush");
+			err_ct++;
+			break;
+		}
+		flushes++;
+
+		ssize_t n;
+		while ((n = read(fds[0], got + read_len, 4096)) > 0)
+			read_len += n;
+	}
+	printf("%zu flushes\n", flushes);
+	CHECK(flushes > 1);
+	CHECK(read_len == want_len - off
+			&& memeq(got, read_len, want + off, want_len - off));
+	CHECK(!irc_outq_peek(&q, &(size_t){0}));
+
+	/* and it is usable again once drained */
+	struct iovec iov = { "PING :x\r\n", 9 };
+	CHECK(!irc_outq_append(&q, &iov, 1) && q.len == 9);
+
+	irc_outq_free(&q);
+	return err_ct;
+}
@@ -0,0 +1,65 @@
+#include "irc_scan.c"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "penny/print.h"
+#include <ccan/array_size/array_size.h>
+
+/* the obvious version, to check against */
+static size_t ref_scan(const char *buf, size_t len, size_t *ends, size_t max)
+{
+	size_t i, ct = 0;
+	for (i = 0; i < len && ct < max; i++)
+		if (buf[i] == '\n')
+			ends[ct++] = i;
+	return ct;
+}
+
+int main(void)
+{
+	size_t err_ct = 0;
+	size_t a[128], b[128];
+
+#define CHECK(buf, len, max) do {					\
+	size_t __c_a = irc_scan_lines(buf, len, a, max);		\
+	size_t __c_b = ref_scan(buf, len, b, max);			\
+	bool __c_ok = __c_a == __c_b &&					\
+		!memcmp(a, b, __c_a * sizeof(*a));			\
+	printf("SCAN(");						\
+	print_bytes_as_cstring(buf, (len) < 40 ? (len) : 40, stdout);	\
+	printf(", %zu, %zu) %zu: %s\n", (size_t)(len), (size_t)(max),	\
+			__c_a, __c_ok ? "yes" : "NO!!!");		\
+	if (!__c_ok)							\
+		err_ct++;						\
+} while (0)
+
+#define C_(s, max) CHECK(s, sizeof(s) - 1, max)
+
+	C_("", 8);
+	C_("\n", 8);
+	C_("PING :a\r\n", 8);
+	C_("PING :a\r\nPING :b\nPING :c", 8);
+	C_("PING :a\r\nPING :b\nPING :c", 1);
+	C_("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n", 128);
+	C_("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n", 5);
+	C_(":nick!user@host PRIVMSG #chan :the quick brown fox\r\n"
+	   ":nick!user@host PRIVMSG #chan :jumps over the lazy dog\r\n"
+	   ":server 353 me = #chan :a b c d e f g h i j k l m\r\n", 128);
+
+	/* every alignment and length, random placement */
+	char buf[300];
+	size_t i, off;
+	srand(1);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = (rand() % 7) ? 'x' : '\n';
+	for (off = 0; off < 40; off++) {
+		size_t len;
+		for (len = 0; len + off <= sizeof(buf); len += 13) {
+			CHECK(buf + off, len, ARRAY_SIZE(a));
+			CHECK(buf + off, len, 3);
+		}
+	}
+
+	return err_ct;
+}
@@ -1,21 +1,14 @@
 
 #include "user-track.h"
 #include "irc.h"
+#include "parse-c-struct-izl.h"
 #include <stdio.h>
 #include <ccan/array_size/array_size.h>
 #include <ccan/container_of/container_of.h>
+#include <ccan/pr_debug/pr_debug.h>
 
 #include <penny/mem.h>
-
-struct ut_ch {
-	struct irc_operation op;
-	struct irc_usertrack_channel *ut;
-};
-
-static struct ut_ch *op_to_ut_ch(struct irc_operation *op)
-{
-	return container_of(op, struct ut_ch, op);
-}
+#include <penny/sprint.h>
 
 /*
  * Space seperated argument handling
@@ -42,30 +35,6 @@ static struct arg next_space_arg(struct arg a, const char *end)
 	     arg.len;	\
 	     arg = next_space_arg(arg, base_arg.data + base_arg.len))
 
-/*
- * IRC arg parsing (space + ':')
- */
-static struct arg first_arg(const char *start, const char *end)
-{
-	if (start != end && *start == ':')
-		return (struct arg){ start + 1, end - (start + 1)};
-	return first_space_arg(start, end);
-}
-
-static struct arg next_arg(struct arg a, const char *end)
-{
-	if (a.data + a.len >= end)
-		return (struct arg) {0, 0};
-	else
-		return first_arg(a.data + a.len + 1, end);
-}
-
-#define irc_for_each_arg(arg, base_arg)		\
-	for (arg = first_arg(base_arg.data, base_arg.data + base_arg.len);	\
-	     arg.len;	\
-	     arg = next_arg(arg, base_arg.data + base_arg.len))
-
-
 static bool is_user_op_marker(int c)
 {
 	switch (c) {
@@ -113,7 +82,7 @@ static void add_nick_to_channel(struct irc_usertrack_channel *ut, struct arg nic
 	if (u)
 		return;
 
-	printf("ADD %.*s\n", (int)nick.len, nick.data);
+	pr_debug(2, "ADD %.*s", (int)nick.len, nick.data);
 
 	u = malloc(offsetof(struct irc_user, nick[nick.len]));
 	if (!u)
@@ -134,10 +103,17 @@ static void remove_nick_from_channel(struct irc_usertrack_channel *ut, struct ar
 	if (u) {
 		free(u);
 	} else {
-		printf("COULD NOT FIND USER %.*s to remove\n", (int)nick.len, nick.data);
+		pr_debug(1, "COULD NOT FIND USER %.*s to remove", (int)nick.len, nick.data);
 	}
 }
 
+static void forget_users(struct irc_usertrack_channel *ut)
+{
+	tommy_hashlin_foreach(&ut->users, free);
+	tommy_hashlin_done(&ut->users);
+	tommy_hashlin_init(&ut->users);
+}
+
 /*
  * RFC 1459:
  *
@@ -154,18 +130,18 @@ static void remove_nick_from_channel(struct irc_usertrack_channel *ut, struct ar
  */
 static int handle_names(struct irc_connection *c,
 		struct irc_operation *op,
-		const char *prefix, size_t prefix_len,
-		const char *remain, size_t remain_len)
+		const struct irc_message *m)
 {
-	struct arg args[2];
-	int r = irc_parse_last_args(remain, remain_len, args, ARRAY_SIZE(args));
-
-	if (r != ARRAY_SIZE(args)) {
-		printf("arg parse failure: %.*s\n", (int)remain_len, remain);
+	if (m->param_ct < 2) {
+		printf("arg parse failure: %.*s\n", (int)m->remain.len,
+				m->remain.data);
 		return -1;
 	}
 
-	struct irc_usertrack_channel *ut = op_to_ut_ch(op)->ut;
+	const struct arg *args = &m->params[m->param_ct - 2];
+
+	struct irc_usertrack_channel *ut = container_of(op,
+			struct irc_usertrack_channel, op_names);
 	if (!memeq(ut->channel, ut->channel_len, args[0].data, args[0].len))
 		return 0;
 
@@ -179,94 +155,73 @@ static int handle_names(struct irc_connection *c,
 /*  */
 static int handle_join(struct irc_connection *c,
 		struct irc_operation *op,
-		const char *prefix, size_t prefix_len,
-		const char *remain, size_t remain_len)
+		const struct irc_message *m)
 {
-	struct arg channel = first_arg(remain, remain + remain_len);
-	if (!channel.len)
+	if (!m->param_ct || !m->params[0].len)
 		return -1;
+	struct arg channel = m->params[0];
 
-	if (!prefix_len)
+	if (!m->nick.len)
 		return -1;
 
-	const char *nick_end = memchr(prefix, '!', prefix_len);
-	if (!nick_end)
-		return -1;
-
-	struct irc_usertrack_channel *ut = op_to_ut_ch(op)->ut;
+	struct irc_usertrack_channel *ut = container_of(op,
+			struct irc_usertrack_channel, op_join);
 	if (!memeq(ut->channel, ut->channel_len, channel.data, channel.len))
 		return 0;
 
-	add_nick_to_channel(ut, (struct arg){ prefix, nick_end - prefix });
+	/* (re)joining, whatever we knew is stale and NAMES will follow */
+	if (memeq(m->nick.data, m->nick.len, c->nick, c->nick_len))
+		forget_users(ut);
+
+	add_nick_to_channel(ut, m->nick);
 	return 0;
 }
 
 static int handle_part(struct irc_connection *c,
 		struct irc_operation *op,
-		const char *prefix, size_t prefix_len,
-		const char *remain, size_t remain_len)
+		const struct irc_message *m)
 {
-	struct arg channel = first_arg(remain, remain + remain_len);
-	if (!channel.len)
-		return -1;
-
-	if (!prefix_len)
+	if (!m->param_ct || !m->params[0].len)
 		return -1;
+	struct arg channel = m->params[0];
 
-	const char *nick_end = memchr(prefix, '!', prefix_len);
-	if (!nick_end)
+	if (!m->nick.len)
 		return -1;
 
-	struct irc_usertrack_channel *ut = op_to_ut_ch(op)->ut;
+	struct irc_usertrack_channel *ut = container_of(op,
+			struct irc_usertrack_channel, op_part);
 	if (!memeq(ut->channel, ut->channel_len, channel.data, channel.len))
 		return 0;
 
-	remove_nick_from_channel(ut, (struct arg){ prefix, nick_end - prefix });
+	remove_nick_from_channel(ut, m->nick);
 	return 0;
 }
 
 int irc_add_usertrack_channel(struct irc_connection *c,
 		struct irc_usertrack_channel *u)
 {
-	struct ut_ch *ut_namreply = malloc(sizeof(*ut_namreply));
-	if (!ut_namreply)
-		return -1;
-	struct ut_ch *ut_join = malloc(sizeof(*ut_join));
-	if (!ut_join)
-		goto e_join;
-	struct ut_ch *ut_part = malloc(sizeof(*ut_part));
-	if (!ut_part)
-		goto e_part;
-
-	*ut_namreply = (struct ut_ch) {
-		.op = {
-			.type = IRC_OP_NUM,
-			.num = RPL_NAMREPLY,
-			.cb = handle_names,
-		},
-		.ut = u,
-	};
-
-	*ut_join = (struct ut_ch) {
-		.op = IRC_OP_STR_INIT(handle_join, "JOIN"),
-		.ut = u,
+	u->op_names = (struct irc_operation) {
+		.type = IRC_OP_NUM,
+		.num = RPL_NAMREPLY,
+		.cb = handle_names,
 	};
+	u->op_join = (struct irc_operation)IRC_OP_STR_INIT(handle_join, "JOIN");
+	u->op_part = (struct irc_operation)IRC_OP_STR_INIT(handle_part, "PART");
 
-	*ut_part = (struct ut_ch) {
-		.op = IRC_OP_STR_INIT(handle_part, "PART"),
-		.ut = u,
-	};
-
-	irc_add_operation(c, &ut_namreply->op);
-	irc_add_operation(c, &ut_join->op);
-	irc_add_operation(c, &ut_part->op);
+	irc_add_operation(c, &u->op_names);
+	irc_add_operation(c, &u->op_join);
+	irc_add_operation(c, &u->op_part);
 	return 0;
+}
 
-e_part:
-	free(ut_join);
-e_join:
-	free(ut_namreply);
-	return -1;
+void irc_remove_usertrack_channel(struct irc_connection *c,
+		struct irc_usertrack_channel *u)
+{
+	irc_remove_operation(c, &u->op_names);
+	irc_remove_operation(c, &u->op_join);
+	irc_remove_operation(c, &u->op_part);
+
+	forget_users(u);
 }
 
 void irc_ut_channel_init_(struct irc_usertrack_channel *ut, const char *channel, size_t channel_len)
@@ -277,3 +232,71 @@ void irc_ut_channel_init_(struct irc_usertrack_channel *ut, const char *channel,
 	};
 	tommy_hashlin_init(&ut->users);
 }
+
+size_t irc_ut_channel_dump(struct irc_usertrack_channel *ut, char *buf,
+		size_t len)
+{
+	struct irc_user *u;
+	tommy_node *node;
+	unsigned i, j;
+
+	size_t users_len = 0;
+	irc_usertrack_channel_for_each_user(ut, u, node, i, j)
+		users_len += 2 + u->nick_len;
+
+	char *users = malloc(users_len + 1);
+	if (!users)
+		return 0;
+
+	/* as in RPL_NAMREPLY */
+	size_t used = 0;
+	irc_usertrack_channel_for_each_user(ut, u, node, i, j) {
+		if (used)
+			users[used++] = ' ';
+		if (u->user_op)
+			users[used++] = u->user_op;
+		memcpy(users + used, u->nick, u->nick_len);
+		used += u->nick_len;
+	}
+
+	size_t r = snprintf(buf, len, "{.users=");
+	r += sprint_bytes_as_cstring(r < len ? buf + r : NULL,
+			r < len ? len - r : 0, users, used);
+	r += snprintf(r < len ? buf + r : NULL, r < len ? len - r : 0, "}");
+	free(users);
+	return r;
+}
+
+struct ut_load {
+	struct c_ilz_ctx i;
+	struct irc_usertrack_channel *ut;
+};
+
+static int load_users(struct c_ilz_ctx *i, const char *id, size_t id_len,
+		const char *str, size_t len)
+{
+	struct irc_usertrack_channel *ut = container_of(i, struct ut_load, i)->ut;
+	if (!memeqstr(id, id_len, "users"))
+		return 0;
+
+	struct arg a, users = { str, len };
+	irc_for_each_space_arg(a, users)
+		add_nick_to_channel(ut, a);
+	return 0;
+}
+
+int irc_ut_channel_load(struct irc_usertrack_channel *ut, const char *buf,
+		size_t len)
+{
+	struct ut_load l = {
+		.i = { .parse_string = load_users },
+		.ut = ut,
+	};
+
+	forget_users(ut);
+	if (parse_struct(&l.i, buf, len) < 0) {
+		forget_users(ut);
+		return -1;
+	}
+	return 0;
+}
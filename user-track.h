@@ -6,6 +6,8 @@
 #include <assert.h>
 #include <stdlib.h>
 
+#include "irc.h"
+
 struct irc_user {
 	tommy_node node;
 	int user_op;
@@ -18,6 +20,11 @@ struct irc_usertrack_channel {
 	size_t channel_len;
 
 	tommy_hashlin users;
+
+	/* registered by irc_add_usertrack_channel() */
+	struct irc_operation op_names;
+	struct irc_operation op_join;
+	struct irc_operation op_part;
 };
 
 /*
@@ -25,9 +32,6 @@ struct irc_usertrack {
 };
 */
 
-struct irc_connection;
-
-
 void irc_ut_channel_init_(struct irc_usertrack_channel *ut,
 		const char *channel, size_t channel_len);
 static inline void irc_ut_channel_init(struct irc_usertrack_channel *ut, const char *channel)
@@ -37,6 +41,20 @@ static inline void irc_ut_channel_init(struct irc_usertrack_channel *ut, const c
 
 int irc_add_usertrack_channel(struct irc_connection *c,
 		struct irc_usertrack_channel *u);
+/* stop tracking and forget all users */
+void irc_remove_usertrack_channel(struct irc_connection *c,
+		struct irc_usertrack_channel *u);
+
+/*
+ * The users of @ut, to be carried over an exec along with irc_dump_state()
+ * and restored with irc_ut_channel_load() instead of asking for NAMES again.
+ * return: as irc_dump_state()
+ */
+size_t irc_ut_channel_dump(struct irc_usertrack_channel *ut, char *buf,
+		size_t len);
+/* return: 0, or -1 (having forgotten every user) if @buf can't be parsed */
+int irc_ut_channel_load(struct irc_usertrack_channel *ut, const char *buf,
+		size_t len);
 
 
 